@@ -11,39 +11,6 @@
 
 #include "config.h"
 
-enum race_effect {
-	RACE_OPEN,
-	RACE_TRIGGER,
-	RACE_CLOSE,
-};
-
-static void update_point(struct k_race_config *cfg,
-			 const char *desc, enum race_effect effect) {
-	struct k_race_point *point = &cfg->race_points[cfg->num_race_points];
-	point->description = desc;
-	cfg->num_race_points++;
-	for (int i = 0; i < cfg->num_race_points-1; i++) {
-		struct k_race_point *p = &cfg->race_points[i];
-		if (!strcmp(point->description, p->description)) { // TODO: +0x5 vs +5
-			point = &cfg->race_points[i];
-			cfg->num_race_points--;
-			break;
-		}
-	}
-
-	switch (effect) {
-	case RACE_OPEN:
-		point->opens = 1;
-		break;
-	case RACE_TRIGGER:
-		point->triggers = 1;
-		break;
-	case RACE_CLOSE:
-		point->closes = 1;
-		break;
-	}
-}
-
 static int get_string_array(json_object *config, const char *key,
 			    int *n, const char ***dst) {
 	json_object *arr;
@@ -85,53 +52,390 @@ static int get_string_array(json_object *config, const char *key,
 	return 0;
 }
 
-static int add_race_points(struct k_race_config *cfg,
-			   const char *key,
-			   enum race_effect effect) {
-	const char **descriptions;
-	int n;
-	int err = get_string_array(cfg->json_config, key, &n, &descriptions);
+// Returns the index of the race point described by desc, adding it if
+// it's new, or a negative errno. A race point's args and filter can be
+// given wherever it's used, but they can't differ.
+static int add_point(struct k_race_config *cfg, const char *desc,
+		     enum k_race_role role, json_object *args,
+		     const char *filter) {
+	int i;
+
+	for (i = 0; i < cfg->num_race_points; i++)
+		if (!strcmp(desc, cfg->race_points[i].description)) // TODO: +0x5 vs +5
+			break;
+	if (i == cfg->num_race_points) {
+		struct k_race_point *p = realloc(cfg->race_points,
+						 sizeof(*p) * (i + 1));
+		if (!p)
+			return -ENOMEM;
+		cfg->race_points = p;
+		memset(&p[i], 0, sizeof(*p));
+		p[i].description = desc;
+		cfg->num_race_points++;
+	}
+
+	struct k_race_point *point = &cfg->race_points[i];
+	if (args) {
+		if (point->args && !json_object_equal(point->args, args)) {
+			fprintf(stderr, "race point %s is given different \"args\"\n", desc);
+			return -EINVAL;
+		}
+		point->args = args;
+	}
+	if (filter) {
+		if (point->filter && strcmp(point->filter, filter)) {
+			fprintf(stderr, "race point %s is given different \"filter\"s\n", desc);
+			return -EINVAL;
+		}
+		point->filter = filter;
+	}
+	switch (role) {
+	case K_RACE_OPEN:
+		point->opens = 1;
+		break;
+	case K_RACE_TRIGGER:
+		point->triggers = 1;
+		break;
+	case K_RACE_CLOSE:
+		point->closes = 1;
+		break;
+	}
+	return i;
+}
+
+static struct k_race_pattern *new_pattern(struct k_race_config *cfg,
+					  enum k_race_role role) {
+	struct k_race_pattern *p = realloc(cfg->patterns,
+					   sizeof(*p) * (cfg->num_patterns + 1));
+	if (!p)
+		return NULL;
+	cfg->patterns = p;
+	p += cfg->num_patterns++;
+	memset(p, 0, sizeof(*p));
+	p->role = role;
+	return p;
+}
+
+static int parse_thread(const char *key, json_object *jthread,
+			enum k_race_role role, enum k_race_thread *thread) {
+	const char *str = json_object_get_string(jthread);
+
+	if (!json_object_is_type(jthread, json_type_string)) {
+		fprintf(stderr, "\"thread\" in \"%s\" should be a string\n", key);
+		return EINVAL;
+	}
+	if (!strcmp(str, "same")) {
+		*thread = K_RACE_THREAD_SAME;
+	} else if (!strcmp(str, "other")) {
+		*thread = K_RACE_THREAD_OTHER;
+	} else if (!strcmp(str, "any")) {
+		*thread = K_RACE_THREAD_ANY;
+	} else {
+		fprintf(stderr, "\"thread\" in \"%s\" should be \"same\", \"other\" or \"any\", "
+			"not \"%s\"\n", key, str);
+		return EINVAL;
+	}
+	if (role != K_RACE_TRIGGER && *thread != K_RACE_THREAD_SAME) {
+		fprintf(stderr, "\"%s\" only happens in the window's own thread\n", key);
+		return EINVAL;
+	}
+	return 0;
+}
+
+// {"name": "fetch arg", ...}
+static int check_args(const char *key, json_object *args) {
+	if (!json_object_is_type(args, json_type_object))
+		goto bad;
+	json_object_object_foreach(args, name, val) {
+		if (!*name || !json_object_is_type(val, json_type_string))
+			goto bad;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "\"args\" in \"%s\" should map names to kprobe fetch args\n", key);
+	return EINVAL;
+}
+
+static int get_string(const char *key, json_object *obj, const char *field,
+		      const char **dst) {
+	json_object *jstr;
+
+	json_object_object_get_ex(obj, field, &jstr);
+	if (!jstr) {
+		*dst = NULL;
+		return 0;
+	}
+	if (!json_object_is_type(jstr, json_type_string)) {
+		fprintf(stderr, "\"%s\" in \"%s\" should be a string\n", field, key);
+		return EINVAL;
+	}
+	*dst = json_object_get_string(jstr);
+	return 0;
+}
+
+// jstep is a race point, or {"point": race point, "thread": which,
+// "args": {...}, "filter": "...", "same_as_open": "arg"}
+static int add_step(struct k_race_config *cfg, const char *key,
+		    struct k_race_pattern *pattern, json_object *jstep) {
+	enum k_race_thread thread = pattern->role == K_RACE_TRIGGER ?
+		K_RACE_THREAD_OTHER : K_RACE_THREAD_SAME;
+	json_object *args = NULL;
+	const char *filter = NULL, *same_as_open = NULL;
+	const char *desc;
+
+	if (json_object_is_type(jstep, json_type_object)) {
+		json_object *jthread;
+		int err;
+
+		err = get_string(key, jstep, "point", &desc);
+		if (err)
+			return err;
+		if (!desc) {
+			fprintf(stderr, "steps in \"%s\" need a \"point\" string\n", key);
+			return EINVAL;
+		}
+		json_object_object_get_ex(jstep, "thread", &jthread);
+		if (jthread) {
+			err = parse_thread(key, jthread, pattern->role, &thread);
+			if (err)
+				return err;
+		}
+		json_object_object_get_ex(jstep, "args", &args);
+		if (args) {
+			err = check_args(key, args);
+			if (err)
+				return err;
+		}
+		err = get_string(key, jstep, "filter", &filter);
+		if (err)
+			return err;
+		err = get_string(key, jstep, "same_as_open", &same_as_open);
+		if (err)
+			return err;
+		if (same_as_open && pattern->role == K_RACE_OPEN) {
+			fprintf(stderr, "\"same_as_open\" doesn't make sense in \"%s\"\n", key);
+			return EINVAL;
+		}
+	} else if (json_object_is_type(jstep, json_type_string)) {
+		desc = json_object_get_string(jstep);
+	} else {
+		fprintf(stderr, "steps in \"%s\" should be strings or objects\n", key);
+		return EINVAL;
+	}
+
+	if (pattern->num_steps == K_RACE_MAX_STEPS) {
+		fprintf(stderr, "patterns in \"%s\" can have at most %d steps\n",
+			key, K_RACE_MAX_STEPS);
+		return EINVAL;
+	}
+	struct k_race_step *steps = realloc(pattern->steps,
+					    sizeof(*steps) * (pattern->num_steps + 1));
+	if (!steps)
+		return ENOMEM;
+	pattern->steps = steps;
+
+	int point = add_point(cfg, desc, pattern->role, args, filter);
+	if (point < 0)
+		return -point;
+	steps[pattern->num_steps].point = point;
+	steps[pattern->num_steps].thread = thread;
+	steps[pattern->num_steps].same_as_open = same_as_open;
+	pattern->num_steps++;
+	return 0;
+}
+
+// {"all_of": [steps], "within_ns": n}, or "sequence" instead of
+// "all_of" if they have to happen in order
+static int add_conjunction(struct k_race_config *cfg, const char *key,
+			   enum k_race_role role, json_object *obj,
+			   json_object *jsteps, int ordered) {
+	json_object *jwithin;
+
+	if (!json_object_is_type(jsteps, json_type_array) ||
+	    json_object_array_length(jsteps) < 1) {
+		fprintf(stderr, "\"%s\" in \"%s\" should be a non-empty array\n",
+			ordered ? "sequence" : "all_of", key);
+		return EINVAL;
+	}
+
+	struct k_race_pattern *pattern = new_pattern(cfg, role);
+	if (!pattern)
+		return ENOMEM;
+	pattern->ordered = ordered;
+
+	json_object_object_get_ex(obj, "within_ns", &jwithin);
+	if (jwithin) {
+		if (!json_object_is_type(jwithin, json_type_int) ||
+		    json_object_get_int64(jwithin) < 0) {
+			fprintf(stderr, "\"within_ns\" in \"%s\" should be a "
+				"non-negative int\n", key);
+			return EINVAL;
+		}
+		pattern->within_ns = json_object_get_int64(jwithin);
+	}
+
+	for (int i = 0; i < json_object_array_length(jsteps); i++) {
+		int err = add_step(cfg, key, pattern,
+				   json_object_array_get_idx(jsteps, i));
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+// one way for the role to happen: a single step or a conjunction
+static int add_alternative(struct k_race_config *cfg, const char *key,
+			   enum k_race_role role, json_object *alt) {
+	json_object *jsteps;
+
+	if (json_object_is_type(alt, json_type_object)) {
+		json_object_object_get_ex(alt, "all_of", &jsteps);
+		if (jsteps)
+			return add_conjunction(cfg, key, role, alt, jsteps, 0);
+		json_object_object_get_ex(alt, "sequence", &jsteps);
+		if (jsteps)
+			return add_conjunction(cfg, key, role, alt, jsteps, 1);
+	} else if (!json_object_is_type(alt, json_type_string)) {
+		fprintf(stderr, "config field \"%s\" should be a string, an object "
+			"or an array of them\n", key);
+		return EINVAL;
+	}
+
+	struct k_race_pattern *pattern = new_pattern(cfg, role);
+	if (!pattern)
+		return ENOMEM;
+	return add_step(cfg, key, pattern, alt);
+}
+
+static int add_race_patterns(struct k_race_config *cfg, const char *key,
+			     enum k_race_role role) {
+	int num_patterns = cfg->num_patterns;
+	json_object *jrole;
+	int err = 0;
+
+	json_object_object_get_ex(cfg->json_config, key, &jrole);
+	if (jrole && json_object_is_type(jrole, json_type_array)) {
+		for (int i = 0; !err && i < json_object_array_length(jrole); i++)
+			err = add_alternative(cfg, key, role,
+					      json_object_array_get_idx(jrole, i));
+	} else if (jrole) {
+		err = add_alternative(cfg, key, role, jrole);
+	}
 	if (err)
 		return err;
-	if (n < 1) {
+	if (cfg->num_patterns == num_patterns) {
 		fprintf(stderr, "please specify at least one symbol in %s\n", key);
 		return EINVAL;
 	}
-	struct k_race_point *p = realloc(cfg->race_points,
-					 sizeof(struct k_race_point) *
-					 (cfg->num_race_points + n));
-	if (!p) {
-		free(descriptions);
+	return 0;
+}
+
+static void free_race_config(struct k_race_config *cfg) {
+	for (int i = 0; i < cfg->num_patterns; i++)
+		free(cfg->patterns[i].steps);
+	free(cfg->patterns);
+	for (int i = 0; i < cfg->num_race_points; i++)
+		free(cfg->race_points[i].fetch_args);
+	free(cfg->race_points);
+}
+
+// "dentry=%di ret=$retval" from {"dentry": "%di", "ret": "$retval"}
+static int make_fetch_args(struct k_race_point *point) {
+	size_t len = 0;
+
+	json_object_object_foreach(point->args, name, val)
+		len += strlen(name) + 1 + strlen(json_object_get_string(val)) + 1;
+	point->fetch_args = malloc(len + 1);
+	if (!point->fetch_args)
 		return ENOMEM;
+
+	char *s = point->fetch_args;
+	json_object_object_foreach(point->args, n, v)
+		s += sprintf(s, "%s%s=%s", s == point->fetch_args ? "" : " ",
+			     n, json_object_get_string(v));
+	return 0;
+}
+
+static int set_value_arg(struct k_race_point *point, const char *name) {
+	if (!point->args || !json_object_object_get_ex(point->args, name, NULL)) {
+		fprintf(stderr, "race point %s has no arg \"%s\" to compare\n",
+			point->description, name);
+		return EINVAL;
 	}
-	memset(p + cfg->num_race_points, 0,
-	       sizeof(*p) * n);
-	cfg->race_points = p;
-	for (int i = 0; i < n; i++) {
-		update_point(cfg, descriptions[i], effect);
+	if (point->value_arg && strcmp(point->value_arg, name)) {
+		fprintf(stderr, "race point %s can only have one arg compared, not "
+			"both \"%s\" and \"%s\"\n", point->description,
+			point->value_arg, name);
+		return EINVAL;
+	}
+	point->value_arg = name;
+	return 0;
+}
+
+// Decide which arg each race point's hits carry. Points with
+// same_as_open steps carry the arg they compare, and opening points
+// carry whichever of those they have.
+static int resolve_values(struct k_race_config *cfg) {
+	for (int i = 0; i < cfg->num_patterns; i++) {
+		struct k_race_pattern *p = &cfg->patterns[i];
+
+		for (int j = 0; j < p->num_steps; j++) {
+			const char *name = p->steps[j].same_as_open;
+			int found = 0;
+
+			if (!name)
+				continue;
+			int err = set_value_arg(&cfg->race_points[p->steps[j].point], name);
+			if (err)
+				return err;
+			for (int k = 0; k < cfg->num_patterns; k++) {
+				struct k_race_pattern *open = &cfg->patterns[k];
+
+				if (open->role != K_RACE_OPEN)
+					continue;
+				for (int l = 0; l < open->num_steps; l++) {
+					struct k_race_point *point =
+						&cfg->race_points[open->steps[l].point];
+
+					if (!point->args ||
+					    !json_object_object_get_ex(point->args, name, NULL))
+						continue;
+					err = set_value_arg(point, name);
+					if (err)
+						return err;
+					found = 1;
+				}
+			}
+			if (!found) {
+				fprintf(stderr, "nothing in \"opened_by\" has an arg \"%s\" "
+					"to be the same as\n", name);
+				return EINVAL;
+			}
+		}
 	}
-	free(descriptions);
 	return 0;
 }
 
 static int parse_race_config(struct k_race_config *cfg) {
 	int err;
 
-	err = add_race_points(cfg, "opened_by", RACE_OPEN);
+	err = add_race_patterns(cfg, "opened_by", K_RACE_OPEN);
 	if (err)
-		goto out_free;
-	err = add_race_points(cfg, "triggered_by", RACE_TRIGGER);
+		return err;
+	err = add_race_patterns(cfg, "triggered_by", K_RACE_TRIGGER);
 	if (err)
-		goto out_free;
-	err = add_race_points(cfg, "closed_by", RACE_CLOSE);
+		return err;
+	err = add_race_patterns(cfg, "closed_by", K_RACE_CLOSE);
 	if (err)
-		goto out_free;
-	return 0;
+		return err;
+	for (int i = 0; i < cfg->num_race_points; i++) {
+		struct k_race_point *point = &cfg->race_points[i];
 
-out_free:
-	if (cfg->race_points)
-		free(cfg->race_points);
-	return err;
+		if (point->args && make_fetch_args(point))
+			return ENOMEM;
+	}
+	return resolve_values(cfg);
 }
 
 static int parse_sched_policy(json_object *sched_config,
@@ -280,8 +584,7 @@ struct k_race_config *k_race_config_parse(int num_funcs, const char *filename) {
 	return cfg;
 
 out_free_race:
-	if (cfg->race_points)
-		free(cfg->race_points);
+	free_race_config(cfg);
 	free(cfg->comms);
 out_free_sched:
 	free(cfg->sched_config);
@@ -295,7 +598,7 @@ void k_race_config_free(struct k_race_config *config) {
 	json_object_put(config->json_config);
 	if (config->comms)
 		free(config->comms);
-	free(config->race_points);
+	free_race_config(config);
 	free(config->sched_config);
 	free(config);
 }
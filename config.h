@@ -4,17 +4,66 @@
 #include <json.h>
 #include <sched.h>
 
+// opens, triggers and closes are set if the point is a step in one of
+// that role's patterns
 struct k_race_point {
 	const char *description;
+	// "args" from the config, names to kprobe fetch args, or NULL
+	json_object *args;
+	// the same as kprobe fetch args, like "dentry=%di ret=$retval"
+	char *fetch_args;
+	// ftrace filter on the args, or NULL
+	const char *filter;
+	// The arg whose value goes along with each hit, for
+	// k_race_step.same_as_open, or NULL.
+	const char *value_arg;
 	int opens;
 	int triggers;
 	int closes;
 };
 
+enum k_race_role {
+	K_RACE_OPEN,
+	K_RACE_TRIGGER,
+	K_RACE_CLOSE,
+};
+
+// Which pids a step of a pattern counts from, relative to the one
+// whose window it is. Opening and closing is always K_RACE_THREAD_SAME.
+enum k_race_thread {
+	K_RACE_THREAD_OTHER,
+	K_RACE_THREAD_SAME,
+	K_RACE_THREAD_ANY,
+};
+
+// The role happens once every step's race point has been hit, in order
+// if ordered, and all within within_ns of the first unless it's 0. A
+// trigger only counts if all of it happened inside the window.
+struct k_race_pattern {
+	enum k_race_role role;
+	int ordered;
+	unsigned long long within_ns;
+	int num_steps;
+	struct k_race_step {
+		// index into race_points
+		int point;
+		enum k_race_thread thread;
+		// If not NULL, only counts when this arg of the point is
+		// the same as the one the window's opening steps carried.
+		const char *same_as_open;
+	} *steps;
+};
+
+// most steps in one pattern
+#define K_RACE_MAX_STEPS 64
+
 struct k_race_config {
 	const char *name;
 	int num_race_points;
 	struct k_race_point *race_points;
+	// any one of a role's patterns makes it happen
+	int num_patterns;
+	struct k_race_pattern *patterns;
 	int num_funcs;
 	struct k_race_sched_config {
 		int sched_policy;
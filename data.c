@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "data.h"
+
+int print_data_header(FILE *out, uint32_t num_params, const char *name,
+		      int free_running) {
+	char *magic = "k_race_data";
+	uint32_t np = htole32(num_params);
+	uint32_t version = htole32(DATA_FORMAT_VERSION);
+	uint32_t bins = htole32(JITTER_BINS);
+	uint64_t width = htole64(free_running ? FREE_RUN_BIN_WIDTH : JITTER_BIN_WIDTH);
+	uint32_t mode = htole32(free_running ? DATA_MODE_FREE_RUNNING : DATA_MODE_ROUNDS);
+
+	if (fputs(magic, out) == EOF)
+		return -1;
+
+	if (fwrite(&np, sizeof(np), 1, out) != 1)
+		return -1;
+	if (fwrite(&version, sizeof(version), 1, out) != 1)
+		return -1;
+	if (fwrite(&bins, sizeof(bins), 1, out) != 1)
+		return -1;
+	if (fwrite(&width, sizeof(width), 1, out) != 1)
+		return -1;
+	if (fwrite(&mode, sizeof(mode), 1, out) != 1)
+		return -1;
+	return 0;
+}
+
+int print_data(FILE *out, int n, uint64_t *params, uint32_t counts, uint32_t triggers,
+	       int64_t near_miss, const uint32_t *jitter) {
+	for (int i = 0; i < n; i++) {
+		uint64_t p = htole64(params[i]);
+		if (fwrite(&p, sizeof(p), 1, out) != 1)
+			return -1;
+	}
+
+	counts = htole32(counts);
+	triggers = htole32(triggers);
+	if (fwrite(&counts, sizeof(counts), 1, out) != 1)
+		return -1;
+	if (fwrite(&triggers, sizeof(triggers), 1, out) != 1)
+		return -1;
+	uint64_t miss = htole64(near_miss);
+	if (fwrite(&miss, sizeof(miss), 1, out) != 1)
+		return -1;
+	for (int i = 0; i < n * JITTER_BINS; i++) {
+		uint32_t j = htole32(jitter[i]);
+		if (fwrite(&j, sizeof(j), 1, out) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+void add_jitter(uint32_t *jitter, long d, long width) {
+	// round towards -infinity so that bin JITTER_BINS/2 is [0, width)
+	long bin = d >= 0 ? d / width : -((-d + width - 1) / width);
+
+	bin += JITTER_BINS / 2;
+	if (bin < 0)
+		bin = 0;
+	if (bin >= JITTER_BINS)
+		bin = JITTER_BINS - 1;
+	jitter[bin]++;
+}
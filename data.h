@@ -0,0 +1,39 @@
+#ifndef DATA_H
+#define DATA_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The results file format examine.py reads, written by k_race_loop()
+// and k-race-replay.
+
+#define DATA_FORMAT_VERSION 4
+
+// Histogram of achieved minus requested offsets. The two end bins also
+// count everything past them.
+#define JITTER_BINS 32
+#define JITTER_BIN_WIDTH 10
+// With free_running, the histogram is of the offsets each trigger
+// happened at instead, which are spread out a lot more.
+#define FREE_RUN_BIN_WIDTH 100
+// In place of a free-running round's offsets when some other target
+// wasn't being called yet, or anymore, so there was nothing for that
+// call to overlap with. Those rounds stay out of the histogram.
+#define FREE_RUN_UNPAIRED LONG_MIN
+
+enum data_mode {
+	DATA_MODE_ROUNDS,
+	DATA_MODE_FREE_RUNNING,
+};
+
+int print_data_header(FILE *out, uint32_t num_params, const char *name,
+		      int free_running);
+// jitter has JITTER_BINS entries per param, and near_miss is like
+// tracer_results.near_miss, INT64_MAX if there wasn't one
+int print_data(FILE *out, int n, uint64_t *params, uint32_t counts, uint32_t triggers,
+	       int64_t near_miss, const uint32_t *jitter);
+// count d in the right bin of a JITTER_BINS long histogram
+void add_jitter(uint32_t *jitter, long d, long width);
+
+#endif
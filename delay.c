@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "delay.h"
+
+#define CALIBRATION_ROUNDS 200
+// long enough that the kernel actually arms a timer, short enough
+// that calibrating doesn't take forever
+#define CALIBRATION_SLEEP 20000
+
+static int long_cmp(const void *a, const void *b) {
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	if (x < y)
+		return -1;
+	return x > y;
+}
+
+static long measure_clock_cost(void) {
+	long best = 1000000;
+
+	for (int i = 0; i < 1000; i++) {
+		long long start = delay_now();
+		long long end = delay_now();
+		if (end - start < best)
+			best = end - start;
+	}
+	return best;
+}
+
+static long measure_sleep_overshoot(void) {
+	long overshoots[CALIBRATION_ROUNDS];
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = CALIBRATION_SLEEP,
+	};
+
+	for (int i = 0; i < CALIBRATION_ROUNDS; i++) {
+		long long start = delay_now();
+		nanosleep(&ts, NULL);
+		overshoots[i] = delay_now() - start - CALIBRATION_SLEEP;
+		if (overshoots[i] < 0)
+			overshoots[i] = 0;
+	}
+	qsort(overshoots, CALIBRATION_ROUNDS, sizeof(long), long_cmp);
+	return overshoots[CALIBRATION_ROUNDS * 95 / 100];
+}
+
+void delay_calibrate(struct delay_calibration *cal) {
+	// The default 50us of slack for SCHED_OTHER threads is way bigger
+	// than anything we care about. RT threads already get zero.
+	if (prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0))
+		perror("prctl(PR_SET_TIMERSLACK)");
+
+	cal->clock_cost = measure_clock_cost();
+	cal->sleep_overshoot = measure_sleep_overshoot();
+	// sleeping for less than the overshoot is pointless, and sleeping
+	// for only a little more than that isn't worth the jitter
+	cal->spin_threshold = 2 * cal->sleep_overshoot + CALIBRATION_SLEEP;
+}
+
+long long delay_until(const struct delay_calibration *cal, long long deadline) {
+	long long now = delay_now();
+	long long remaining = deadline - now;
+
+	if (remaining > cal->spin_threshold) {
+		long long sleep = remaining - cal->sleep_overshoot;
+		struct timespec ts = {
+			.tv_sec = sleep / 1000000000,
+			.tv_nsec = sleep % 1000000000,
+		};
+		nanosleep(&ts, NULL);
+	}
+
+	// On average the first read past the deadline lands half a clock
+	// read after it, so aim a bit early to center the error on zero.
+	deadline -= cal->clock_cost / 2;
+	do {
+		now = delay_now();
+	} while (now < deadline);
+	return now;
+}
+
+// how many round trips delay_measure_skew() takes the best of
+#define SKEW_ROUNDS 1000
+// How long delay_measure_skew() gives them all. If a worker is spinning
+// on one of the CPUs with a realtime priority, our thread there might
+// never run, and then we give up rather than hang.
+#define SKEW_TIMEOUT_NS 100000000LL
+
+// Shared by delay_measure_skew() and the two threads, and freed by
+// whichever of them is done with it last, since if one of the threads
+// never got to run, it's left behind detached.
+struct skew_probe {
+	int refs;
+	// DELAY_CLOCK time to give up at
+	long long deadline;
+	// odd while a ping is out, and bumped again by the reply
+	int seq;
+	int stop;
+	int timed_out;
+	// the other CPU's time when it replied
+	long long reply;
+	long long best_rtt;
+	long long skew;
+};
+
+static void put_probe(struct skew_probe *p) {
+	if (!__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+		free(p);
+}
+
+// Only looks at the clock every so often, so that checking doesn't
+// slow down noticing the other side's reply.
+static inline int past_deadline(struct skew_probe *p, unsigned int *spins) {
+	return !(++*spins % 1024) && delay_now() > p->deadline;
+}
+
+static void *skew_pong(void *arg) {
+	struct skew_probe *p = arg;
+	unsigned int spins = 0;
+	int seen = 0;
+
+	while (1) {
+		int seq;
+
+		while ((seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE)) == seen)
+			if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE) ||
+			    past_deadline(p, &spins))
+				goto out;
+		p->reply = delay_now();
+		seen = seq + 1;
+		__atomic_store_n(&p->seq, seen, __ATOMIC_RELEASE);
+	}
+out:
+	put_probe(p);
+	return NULL;
+}
+
+static void *skew_ping(void *arg) {
+	struct skew_probe *p = arg;
+	unsigned int spins = 0;
+
+	p->best_rtt = LLONG_MAX;
+	for (int i = 0; i < SKEW_ROUNDS; i++) {
+		int seq = 2 * i + 1;
+		long long sent = delay_now();
+		long long back;
+
+		__atomic_store_n(&p->seq, seq, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&p->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+			if (past_deadline(p, &spins)) {
+				p->timed_out = 1;
+				goto out;
+			}
+		}
+		back = delay_now();
+		// the reply happened somewhere in between, and the tighter
+		// the round trip, the less room for error
+		if (back - sent < p->best_rtt) {
+			p->best_rtt = back - sent;
+			p->skew = p->reply - (sent + back) / 2;
+		}
+	}
+out:
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	put_probe(p);
+	return NULL;
+}
+
+static int start_pinned(pthread_t *thread, int cpu, void *(*fn)(void *),
+			struct skew_probe *p) {
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+	int err = pthread_create(thread, &attr, fn, p);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		__atomic_sub_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "pthread create error: %s\n", strerror(err));
+	}
+	return err;
+}
+
+// Join thread if it's done by the deadline, and otherwise leave it to
+// finish on its own whenever it gets to run.
+static int join_by(pthread_t thread, const struct timespec *deadline) {
+	int err = pthread_timedjoin_np(thread, NULL, deadline);
+
+	if (err)
+		pthread_detach(thread);
+	return err;
+}
+
+int delay_measure_skew(int ref_cpu, int cpu, long long *skew) {
+	struct skew_probe *probe;
+	struct timespec deadline;
+	pthread_t ping, pong;
+
+	if (cpu == ref_cpu) {
+		*skew = 0;
+		return 0;
+	}
+	probe = calloc(1, sizeof(*probe));
+	if (!probe)
+		return ENOMEM;
+	probe->refs = 1;
+	probe->deadline = delay_now() + SKEW_TIMEOUT_NS;
+	// pthread_timedjoin_np() goes by CLOCK_REALTIME
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (deadline.tv_nsec + SKEW_TIMEOUT_NS) / 1000000000;
+	deadline.tv_nsec = (deadline.tv_nsec + SKEW_TIMEOUT_NS) % 1000000000;
+
+	int err = start_pinned(&pong, cpu, skew_pong, probe);
+	if (err)
+		goto out;
+	err = start_pinned(&ping, ref_cpu, skew_ping, probe);
+	if (err) {
+		__atomic_store_n(&probe->stop, 1, __ATOMIC_RELEASE);
+		join_by(pong, &deadline);
+		goto out;
+	}
+	err = join_by(ping, &deadline);
+	if (err)
+		__atomic_store_n(&probe->stop, 1, __ATOMIC_RELEASE);
+	join_by(pong, &deadline);
+	if (!err && probe->timed_out)
+		err = ETIMEDOUT;
+	if (err)
+		fprintf(stderr, "timed out measuring CPU %d's clock skew\n", cpu);
+	else
+		*skew = probe->skew;
+out:
+	put_probe(probe);
+	return err;
+}
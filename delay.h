@@ -0,0 +1,46 @@
+#ifndef DELAY_H
+#define DELAY_H
+
+#include <time.h>
+
+// All start timestamps and busy waits use this clock. Sleeping is
+// always done with a relative nanosleep(), so it doesn't matter that
+// clock_nanosleep() doesn't accept it.
+#define DELAY_CLOCK CLOCK_MONOTONIC_RAW
+
+struct delay_calibration {
+	// cost of one clock_gettime(DELAY_CLOCK) call
+	long clock_cost;
+	// how late nanosleep() wakes up on this CPU (95th percentile)
+	long sleep_overshoot;
+	// delays shorter than this are done by spinning only
+	long spin_threshold;
+};
+
+static inline long long delay_now(void) {
+	struct timespec ts;
+
+	clock_gettime(DELAY_CLOCK, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Must be called from the thread that will use the result, after
+// it's been moved to the CPU(s) it'll run on.
+void delay_calibrate(struct delay_calibration *cal);
+
+// Wait until DELAY_CLOCK reads at least deadline, sleeping for as much
+// of the wait as can be done without overshooting, and spinning for
+// the rest. Returns the time actually read right before returning.
+long long delay_until(const struct delay_calibration *cal, long long deadline);
+
+static inline long long delay_ns(const struct delay_calibration *cal, long ns) {
+	return delay_until(cal, delay_now() + ns);
+}
+
+// How far ahead of ref_cpu's DELAY_CLOCK cpu's is, going by the
+// tightest of a bunch of round trips between threads on the two.
+// Both CPUs need to be free enough for a thread to get scheduled, and
+// if they aren't soon enough, returns ETIMEDOUT and leaves *skew alone.
+int delay_measure_skew(int ref_cpu, int cpu, long long *skew);
+
+#endif
@@ -9,10 +9,10 @@ from mpl_toolkits import mplot3d
 import matplotlib.pyplot as plt
 
 def add_plot(fig, data):
-    if data.shape[1] > 4:
+    if data.shape[1] > 5:
         raise ValueError('Plotting with more than 3 k-race threads not suppoorted')
 
-    if data.shape[1] == 4:
+    if data.shape[1] == 5:
         ax = fig.add_subplot(projection='3d')
         ax.scatter3D(data['offset_0'], data['offset_1'], data['triggers'])
         ax.set_xlabel('offset 0')
@@ -26,20 +26,23 @@ def add_plot(fig, data):
         ax.set_xlim(min(data['offset_0'])-extra, max(data['offset_0'])+extra)
     ax.set_title('triggers')
 
-def single_datapoint_len(num_params):
-    return num_params*8+4+4
+def single_datapoint_len(data_fmt):
+    return struct.calcsize(data_fmt)
 
 
-def foreach_record(file, data_fmt, num_params, f, lines):
+# f gets the params, counts, triggers and near miss, and the per-param
+# jitter histograms too if full is true
+def foreach_record(file, data_fmt, num_params, f, lines, full=False):
     i = 0
     while True:
         if lines > 0 and i >= lines:
             return
 
-        x = file.read(single_datapoint_len(num_params))
-        if len(x) < single_datapoint_len(num_params):
+        x = file.read(single_datapoint_len(data_fmt))
+        if len(x) < single_datapoint_len(data_fmt):
             return
-        f(struct.unpack(data_fmt, x))
+        record = struct.unpack(data_fmt, x)
+        f(record if full else record[:num_params+3])
         i += 1
 
 
@@ -48,8 +51,10 @@ def k_race_file_parse_header(filename, file):
     if magic != b'k_race_data':
         raise ValueError('%s does not appear to be a k-race output file' % filename)
 
-    nump = file.read(4)
-    num_params = struct.unpack('<I', nump)[0]
+    num_params, version = struct.unpack('<II', file.read(8))
+    if version < 4:
+        raise ValueError('%s was written by an old version of k-race' % filename)
+    jitter_bins, jitter_width, mode = struct.unpack('<IQI', file.read(16))
 
     # little endian
     data_fmt = '<'
@@ -58,7 +63,11 @@ def k_race_file_parse_header(filename, file):
         data_fmt += 'q'
         # unsigned 32 bits for counts and triggers
     data_fmt += 'II'
-    return data_fmt, num_params
+    # signed 64 bits for the closest near miss in ns
+    data_fmt += 'q'
+    # and for each bin of each param's jitter histogram
+    data_fmt += 'I' * (num_params * jitter_bins)
+    return data_fmt, num_params, jitter_bins, jitter_width, mode
 
 
 def k_race_file_foreach_record(file, f, data_fmt, num_params, lines):
@@ -69,14 +78,14 @@ def k_race_file_foreach_record(file, f, data_fmt, num_params, lines):
         lines = -lines
         start = file.seek(0, os.SEEK_CUR)
         end = file.seek(0, os.SEEK_END)
-        end -= (end - start) % single_datapoint_len(num_params)
+        end -= (end - start) % single_datapoint_len(data_fmt)
 
-        p = end - lines * single_datapoint_len(num_params)
+        p = end - lines * single_datapoint_len(data_fmt)
         if p < start:
             p = start
         file.seek(p, os.SEEK_SET)
         data = foreach_record(file, data_fmt, num_params, f, lines)
-        index_start = (p-start)/single_datapoint_len(num_params)
+        index_start = (p-start)/single_datapoint_len(data_fmt)
     return index_start
 
 
@@ -93,17 +102,52 @@ def read_k_race_file(file, data_fmt, num_params, columns):
     return ret
 
 
+# near miss of records that didn't have one
+NO_NEAR_MISS = 2**63 - 1
+
 def print_k_race_file(file, data_fmt, num_params, columns, lines):
     fmt = '{:>10}'*(num_params+1)
-    print((fmt+'{:>10}').format(*columns))
-    fmt += '{:>10.5}'
+    print((fmt+'{:>10}{:>12}').format(*columns))
+    fmt += '{:>10.5}{:>12}'
     def print_record(record):
-        triggers = float(record[-1]) / float(record[-2])
-        print(fmt.format(*record[:-1], triggers))
+        triggers = float(record[-2]) / float(record[-3])
+        near_miss = '-' if record[-1] == NO_NEAR_MISS else record[-1]
+        print(fmt.format(*record[:-2], triggers, near_miss))
 
     k_race_file_foreach_record(file, print_record, data_fmt, num_params, lines)
 
 
+# how the offsets in the file are to be read
+MODE_ROUNDS = 0
+# the offsets are gaps between calls, and the histograms are of the
+# offsets triggers happened at
+MODE_FREE_RUNNING = 1
+
+def print_jitter(file, data_fmt, num_params, bins, width, mode):
+    totals = [[0] * bins for i in range(num_params)]
+    def add_record(record):
+        jitter = record[num_params+3:]
+        for i in range(num_params):
+            for b in range(bins):
+                totals[i][b] += jitter[i*bins + b]
+    foreach_record(file, data_fmt, num_params, add_record, 0, full=True)
+
+    for i in range(num_params):
+        if mode == MODE_FREE_RUNNING:
+            print('offset_%d at triggers (ns):' % i)
+        else:
+            print('offset_%d achieved - requested (ns):' % i)
+        for b in range(bins):
+            lo = (b - bins // 2) * width
+            if b == 0:
+                label = '< %d' % (lo + width)
+            elif b == bins - 1:
+                label = '>= %d' % lo
+            else:
+                label = '[%d, %d)' % (lo, lo + width)
+            print('{:>16}{:>12}'.format(label, totals[i][b]))
+
+
 def main():
     parser = argparse.ArgumentParser(description='display k-race output')
     subparsers = parser.add_subparsers(dest='cmd')
@@ -112,6 +156,8 @@ def main():
                                         help='display a plot of the data (only available for data output by 3 or fewer k-race threads)')
     cat_parser = subparsers.add_parser('cat',
                                        help='dump human-readable data to stdout')
+    jitter_parser = subparsers.add_parser('jitter',
+                                          help='show how far the offsets that actually happened were from the requested ones')
 
     head_parser = subparsers.add_parser('head', help='display the first N lines of the output')
     head_parser.add_argument('-n', dest='n', type=int, default=10, help='the number of lines to print')
@@ -127,17 +173,19 @@ def main():
         sys.exit(1)
 
     file = open(args.file, 'rb')
-    data_fmt, num_params = k_race_file_parse_header(args.file, file)
+    data_fmt, num_params, jitter_bins, jitter_width, mode = k_race_file_parse_header(args.file, file)
     columns = []
     for i in range(num_params):
         columns.append('offset_%d' % i)
-    columns += ['counts', 'triggers']
+    columns += ['counts', 'triggers', 'near_miss']
 
     if args.cmd == 'plot':
         data = read_k_race_file(file, data_fmt, num_params, columns)
         fig = plt.figure()
         add_plot(fig, data)
         plt.show()
+    elif args.cmd == 'jitter':
+        print_jitter(file, data_fmt, num_params, jitter_bins, jitter_width, mode)
     else:
         n = 0
         if args.cmd == 'tail':
@@ -20,15 +20,13 @@ struct worker_arg {
 
 int num_targets = 2;
 
-static int pre(void *user) {
-	struct worker_arg *args = user;
-	for (int i = 0; i < num_targets; i++) {
-		struct worker_arg *arg = &args[i];
-		arg->fd = open("/dev/vchiq", 0);
-		if (arg->fd < 0) {
-			fprintf(stderr, "can't open /dev/vchiq: %m\n");
-			return 1;
-		}
+// each worker opens and checks its own fd, so these run in parallel
+static int pre(void *user, void *a) {
+	struct worker_arg *arg = a;
+	arg->fd = open("/dev/vchiq", 0);
+	if (arg->fd < 0) {
+		fprintf(stderr, "can't open /dev/vchiq: %m\n");
+		return 1;
 	}
 	return 0;
 }
@@ -45,25 +43,17 @@ static int num_instances(const char *vchiq_output) {
 	return ret;
 }
 
-static int post(void *user) {
-	struct worker_arg *args = user;
-	for (int i = 0; i < num_targets; i++) {
-		struct worker_arg *wa = &args[i];
-		int found = num_instances(wa->buf);
-		if (found != NUM_INSTANCES) {
-			printf("BUG!! instances: %d\n", found);
-			return 1;
-		}
-		close(wa->fd);
+static int post(void *user, void *a) {
+	struct worker_arg *wa = a;
+	int found = num_instances(wa->buf);
+	if (found != NUM_INSTANCES) {
+		printf("BUG!! instances: %d\n", found);
+		return 1;
 	}
+	close(wa->fd);
 	return 0;
 }
 
-struct k_race_callbacks callbacks = {
-	.pre = pre,
-	.post = post,
-};
-
 static int vchiq_read(void *ctx, void *arg) {
 	struct worker_arg *wa = arg;
 	return read(wa->fd, wa->buf, BUF_SIZE) <= 0;
@@ -72,9 +62,13 @@ static int vchiq_read(void *ctx, void *arg) {
 struct k_race_target targets[] = {
 	{
 		.func = vchiq_read,
+		.pre = pre,
+		.post = post,
 	},
 	{
 		.func = vchiq_read,
+		.pre = pre,
+		.post = post,
 	},
 };
 
@@ -109,5 +103,5 @@ int main(int argc, char **argv) {
 		return 1;
 
 	return k_race_loop(&opts, num_targets, targets,
-			   &callbacks, args) != 0;
+			   NULL, args) != 0;
 }
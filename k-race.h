@@ -1,10 +1,44 @@
 #ifndef K_RACE_H
 #define K_RACE_H
 
+#include <stddef.h>
+
 struct k_race_target {
 	// return nonzero on error to abort.
 	int (*func)(void *user, void *arg);
 	void *arg;
+	// If not NULL, called by this target's worker before and after
+	// func every round, at the same time as the other targets' pre
+	// and post. The pre hooks only start once every target is done
+	// with the last round, and the global pre callback runs after all
+	// of them. post runs as soon as this target's func returns, so it
+	// can overlap the other targets' funcs, and the global post
+	// callback runs after every target's post.
+	// return nonzero on error to abort.
+	int (*pre)(void *user, void *arg);
+	int (*post)(void *user, void *arg);
+};
+
+// Per-round fixtures (fds, directories, whatever the targets need fresh
+// every round) that get set up and torn down in a background thread
+// instead of between rounds. The thread keeps up to num_slots of them
+// ready at a time, and runs on a CPU none of the workers use if there
+// is one. Each round takes the next prepared slot and passes it to
+// every target's func, pre and post as arg, in place of
+// k_race_target.arg. Only works with thread workers, since fds and
+// such opened in the background thread wouldn't show up in worker
+// processes.
+struct k_race_fixtures {
+	int num_slots;
+	// bytes of zeroed memory k-race allocates for each slot
+	size_t slot_size;
+	// Get slot ready for a round.
+	// return nonzero on error to abort.
+	int (*prepare)(void *user, void *slot);
+	// Called after every target is done with the round slot was
+	// used for, and on anything still prepared when we're done.
+	// return nonzero on error to abort.
+	int (*cleanup)(void *user, void *slot);
 };
 
 struct k_race_callbacks {
@@ -14,6 +48,17 @@ struct k_race_callbacks {
 	// If not NULL, called after each round.
 	// return nonzero on error to abort.
 	int (*post)(void *user);
+	// If not NULL, called once for each shard (see
+	// k_race_options.shards) before any workers start, with that
+	// shard's own copy of the targets. *user starts out as the user
+	// passed to k_race_loop(), and whatever it's set to is what the
+	// shard's targets and callbacks get. Change the targets' args
+	// here too if shards shouldn't share them.
+	// return nonzero on error to abort.
+	int (*init_shard)(int shard, struct k_race_target *targets, void **user);
+	// If not NULL, see struct k_race_fixtures. With more than one
+	// shard, each gets its own slots and background thread.
+	struct k_race_fixtures *fixtures;
 };
 
 struct k_race_options {
@@ -30,6 +75,56 @@ struct k_race_options {
 	// that the precision in estimating what parameters work best
 	// is exponentially bad in num_targets.
 	float explore_probability;
+	// Never sleep in the kernel while waiting for other workers at
+	// the start of a round or batch, just spin. Only a good idea if
+	// each worker has a CPU to itself.
+	int spin_only;
+	// Instead of each worker waiting for its offset after it leaves
+	// the barrier, the last worker into the barrier picks an epoch a
+	// little in the future, and each worker waits until epoch + its
+	// offset. Makes the offsets independent of barrier wakeup order.
+	int absolute_start;
+	// Run each target in its own forked process instead of a thread,
+	// for races that need separate address spaces, fd tables or
+	// credentials. Note that the pre and post callbacks then run in
+	// whichever worker process gets there last, so anything they
+	// change in memory is only seen by the others if it's in shared
+	// memory (e.g. mmap(MAP_SHARED)).
+	int processes;
+	// Run this many independent copies of the targets at once, each
+	// pinned to its own CPUs (one per target, picked from the ones in
+	// the config) and trying its own offsets. They all feed the same
+	// sampler, so with more CPUs you get more results per second.
+	int shards;
+	// Don't run in rounds at all: each worker calls its target over
+	// and over, waiting a gap after each call, with no barrier in
+	// between. The offsets parameters become those gaps, and the
+	// offsets the targets actually overlapped at get worked out
+	// afterwards from the trace. Can't be used with pre and post
+	// callbacks or fixtures, since there are no rounds.
+	int free_running;
+	// If not 0, set the ftrace ring buffers' sub-buffer size to this
+	// many KB (rounded up to a power of 2 pages by the kernel) while
+	// we trace, so that each read or mapped sub-buffer holds more
+	// events. Needs a kernel that has buffer_subbuf_size_kb.
+	int subbuf_size_kb;
+	// Keep track of the race points with BPF programs instead of
+	// going through ftrace, so the counting happens in the kernel
+	// and no events can be lost, however long a batch runs. Results
+	// can only be credited to the requested offsets then, not the
+	// ones each round actually ran with. Needs libk-race built with
+	// make BPF=1, and a 5.15 or later kernel.
+	int bpf;
+	// Open the race points as perf events on just the worker threads
+	// and read them from perf's mmap'd ring buffers, instead of
+	// adding kprobes to ftrace and filtering everybody's events by
+	// pid. Needs a kernel with the kprobe perf PMU (4.17 and later).
+	int perf;
+	// If not NULL, also save every event that counted toward the
+	// results in out_file, along with the offsets and round start
+	// times, so k-race-replay can redo the results with a different
+	// config later.
+	const char *record_file;
 };
 
 int k_race_parse_options(struct k_race_options *opts,
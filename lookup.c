@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "lookup.h"
+
+static void insert_slot(struct pid_slot *slots, unsigned int mask,
+			unsigned long long pid, int target) {
+	unsigned int i = pid_hash(pid, mask);
+
+	while (slots[i].target != -1) {
+		// the first one added keeps the pid, like the old linear scan
+		if (slots[i].pid == pid)
+			return;
+		i = (i + 1) & mask;
+	}
+	slots[i].pid = pid;
+	slots[i].target = target;
+}
+
+int pid_table_reserve(struct pid_table *t, int n) {
+	unsigned int size = t->slots ? t->mask + 1 : 8;
+	unsigned int old_size = size;
+
+	if (t->slots && 2 * n <= size)
+		return 0;
+	while (2 * n > size)
+		size *= 2;
+
+	struct pid_slot *slots = malloc(sizeof(*slots) * size);
+	if (!slots)
+		return ENOMEM;
+	for (unsigned int i = 0; i < size; i++) {
+		slots[i].pid = 0;
+		slots[i].target = -1;
+	}
+	// no pid is in there twice, so the order doesn't matter
+	for (unsigned int i = 0; t->slots && i < old_size; i++)
+		if (t->slots[i].target != -1)
+			insert_slot(slots, size - 1, t->slots[i].pid,
+				    t->slots[i].target);
+	free(t->slots);
+	t->slots = slots;
+	t->mask = size - 1;
+	return 0;
+}
+
+void pid_table_insert(struct pid_table *t, unsigned long long pid, int target) {
+	insert_slot(t->slots, t->mask, pid, target);
+}
+
+void pid_table_free(struct pid_table *t) {
+	free(t->slots);
+	t->slots = NULL;
+	t->mask = 0;
+}
+
+int id_index_build(struct id_index *x, int n, const unsigned long long *ids) {
+	unsigned long long min = ~0ULL, max = 0;
+
+	id_index_free(x);
+	if (!n)
+		return 0;
+	for (int i = 0; i < n; i++) {
+		if (ids[i] < min)
+			min = ids[i];
+		if (ids[i] > max)
+			max = ids[i];
+	}
+	x->slots = malloc(sizeof(*x->slots) * (max - min + 1));
+	if (!x->slots)
+		return ENOMEM;
+	for (unsigned long long i = 0; i < max - min + 1; i++)
+		x->slots[i] = -1;
+	for (int i = n - 1; i >= 0; i--)
+		x->slots[ids[i] - min] = i;
+	x->min = min;
+	x->num = max - min + 1;
+	return 0;
+}
+
+void id_index_free(struct id_index *x) {
+	free(x->slots);
+	x->slots = NULL;
+	x->min = 0;
+	x->num = 0;
+}
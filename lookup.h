@@ -0,0 +1,75 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+// The two tables match_race_event() in trace.c looks every event up
+// in, kept apart from it so lookup-bench can time them without a
+// kernel to trace.
+
+// slot in a pid_table
+struct pid_slot {
+	unsigned long long pid;
+	// target index, or -1 if the slot is empty
+	int target;
+};
+
+// pid -> target, open addressed with linear probing, with a power of 2
+// number of slots kept at most half full. Zeroed is empty.
+struct pid_table {
+	struct pid_slot *slots;
+	unsigned int mask;
+};
+
+static inline unsigned int pid_hash(unsigned long long pid, unsigned int mask) {
+	return (pid * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+}
+
+// Make room for n pids in all. Returns ENOMEM, leaving t as it was, if
+// that fails.
+int pid_table_reserve(struct pid_table *t, int n);
+// Only once pid_table_reserve() has made room. If pid is already in
+// there, it keeps the target it was first added with.
+void pid_table_insert(struct pid_table *t, unsigned long long pid, int target);
+void pid_table_free(struct pid_table *t);
+
+// pid's target, or -1 if it isn't in t
+static inline int pid_table_lookup(const struct pid_table *t,
+				   unsigned long long pid) {
+	if (!t->slots)
+		return -1;
+
+	unsigned int i = pid_hash(pid, t->mask);
+	while (t->slots[i].pid != pid) {
+		if (t->slots[i].target == -1)
+			return -1;
+		i = (i + 1) & t->mask;
+	}
+	// an empty slot can still match pid 0, and it says -1 anyway
+	return t->slots[i].target;
+}
+
+// event id -> race point index. ftrace hands out event ids in order, so
+// the ones for our kprobes are close together, and this is just an
+// array from the smallest of them to the biggest. Zeroed is empty.
+struct id_index {
+	// -1 for ids in between that aren't ours
+	int *slots;
+	unsigned long long min;
+	unsigned long long num;
+};
+
+// Index i gets ids[i], or if two have the same id, the first one does.
+// Returns ENOMEM, leaving x empty, if that fails.
+int id_index_build(struct id_index *x, int n, const unsigned long long *ids);
+void id_index_free(struct id_index *x);
+
+// the index id was given, or -1 if it isn't one of ours
+static inline int id_index_lookup(const struct id_index *x,
+				  unsigned long long id) {
+	// unsigned, so ids below min wrap around and fail too
+	id -= x->min;
+	if (id >= x->num)
+		return -1;
+	return x->slots[id];
+}
+
+#endif
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+// Times the lookups match_race_event() does for every traced event,
+// against the linear scans they replaced, after checking that they
+// give the right answers, including for pids that collide and for
+// misses. Nothing to do with the kernel, so it runs anywhere:
+//
+// make lookup-bench && ./lookup-bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lookup.h"
+
+// events looked up per timing
+#define NUM_EVENTS (1 << 20)
+
+static int failed;
+
+#define check(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);				\
+		fprintf(stderr, "\n");					\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static long long now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// what match_race_event() did before: first match wins
+static int scan_pids(int n, const unsigned long long *pids,
+		     unsigned long long pid) {
+	for (int i = 0; i < n; i++)
+		if (pids[i] == pid)
+			return i;
+	return -1;
+}
+
+static int scan_ids(int n, const unsigned long long *ids,
+		    unsigned long long id) {
+	for (int i = 0; i < n; i++)
+		if (ids[i] == id)
+			return i;
+	return -1;
+}
+
+// the next pid after pid that lands in the same slot in a table with
+// mask, so that they have to be probed past each other
+static unsigned long long colliding_pid(unsigned long long pid,
+					unsigned int mask) {
+	unsigned long long p = pid;
+
+	while (pid_hash(++p, mask) != pid_hash(pid, mask))
+		;
+	return p;
+}
+
+static void check_pids(void) {
+	struct pid_table t = {};
+	unsigned long long pids[16];
+	int n = 0;
+
+	check(pid_table_lookup(&t, 0) == -1, "empty table matched pid 0");
+	check(pid_table_lookup(&t, 100) == -1, "empty table matched pid 100");
+
+	// a chain of collisions at the table's starting size, some
+	// of which stay put after it grows and some of which don't
+	check(!pid_table_reserve(&t, 1), "OOM");
+	unsigned int mask = t.mask;
+	pids[n++] = 1000;
+	for (int i = 0; i < 5; i++, n++)
+		pids[n] = colliding_pid(pids[n - 1], mask);
+	pids[n++] = 4242;
+	pids[n++] = 77;
+	for (int i = 0; i < n; i++) {
+		check(!pid_table_reserve(&t, i + 1), "OOM");
+		pid_table_insert(&t, pids[i], i);
+		check(2 * (i + 1) <= (int)t.mask + 1, "%u slots for %d pids",
+		      t.mask + 1, i + 1);
+	}
+	// the same pid again keeps its first target, like the scan did
+	check(!pid_table_reserve(&t, n + 1), "OOM");
+	pid_table_insert(&t, pids[2], n);
+
+	for (int i = 0; i < n; i++)
+		check(pid_table_lookup(&t, pids[i]) == scan_pids(n, pids, pids[i]),
+		      "pid %llu: got %d, want %d", pids[i],
+		      pid_table_lookup(&t, pids[i]), scan_pids(n, pids, pids[i]));
+
+	// misses, including ones that have to probe past a full chain
+	unsigned long long misses[] = {
+		0, 1, 999, 1001, colliding_pid(pids[5], t.mask),
+		colliding_pid(4242, t.mask), ~0ULL,
+	};
+	for (int i = 0; i < (int)(sizeof(misses) / sizeof(misses[0])); i++) {
+		if (scan_pids(n, pids, misses[i]) >= 0)
+			continue;
+		check(pid_table_lookup(&t, misses[i]) == -1,
+		      "pid %llu isn't there, but got %d", misses[i],
+		      pid_table_lookup(&t, misses[i]));
+	}
+	pid_table_free(&t);
+}
+
+static void check_ids(void) {
+	struct id_index x = {};
+	// with a gap, out of order, and one in twice
+	unsigned long long ids[] = { 1500, 1496, 1510, 1497, 1500 };
+	int n = sizeof(ids) / sizeof(ids[0]);
+
+	check(id_index_lookup(&x, 0) == -1, "empty index matched id 0");
+	check(!id_index_build(&x, n, ids), "OOM");
+	for (unsigned long long id = 1480; id < 1530; id++)
+		check(id_index_lookup(&x, id) == scan_ids(n, ids, id),
+		      "id %llu: got %d, want %d", id, id_index_lookup(&x, id),
+		      scan_ids(n, ids, id));
+	check(id_index_lookup(&x, 0) == -1, "matched id 0");
+	check(id_index_lookup(&x, ~0ULL) == -1, "matched id ~0");
+
+	// building again starts over
+	check(!id_index_build(&x, 1, ids), "OOM");
+	check(id_index_lookup(&x, 1496) == -1, "1496 left over from before");
+	check(!id_index_build(&x, 0, ids), "OOM");
+	check(id_index_lookup(&x, 1500) == -1, "matched with nothing indexed");
+	id_index_free(&x);
+}
+
+// Like a traced CPU: most events are somebody else's, from race points'
+// neighbours in id space or from other pids.
+struct event {
+	unsigned long long id;
+	unsigned long long pid;
+};
+
+static void make_events(struct event *events, int num_pids,
+			const unsigned long long *pids, int num_ids,
+			const unsigned long long *ids) {
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		int r = rand();
+
+		events[i].id = r % 4 ? ids[r % num_ids] : ids[0] + r % (4 * num_ids);
+		r = rand();
+		events[i].pid = r % 2 ? pids[r % num_pids] : 1 + r % 100000;
+	}
+}
+
+static void bench(int num_pids, int num_ids) {
+	unsigned long long pids[num_pids], ids[num_ids];
+	struct event *events = malloc(sizeof(*events) * NUM_EVENTS);
+	struct pid_table t = {};
+	struct id_index x = {};
+	long long matched[2] = {}, took[2];
+
+	if (!events) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		failed = 1;
+		return;
+	}
+	for (int i = 0; i < num_pids; i++)
+		pids[i] = 10000 + 37 * i;
+	for (int i = 0; i < num_ids; i++)
+		ids[i] = 1500 + i;
+	if (pid_table_reserve(&t, num_pids) ||
+	    id_index_build(&x, num_ids, ids)) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		failed = 1;
+		goto out;
+	}
+	for (int i = 0; i < num_pids; i++)
+		pid_table_insert(&t, pids[i], i);
+	make_events(events, num_pids, pids, num_ids, ids);
+
+	// in the same order as match_race_event(), id first
+	long long start = now();
+	for (int i = 0; i < NUM_EVENTS; i++)
+		if (id_index_lookup(&x, events[i].id) >= 0 &&
+		    pid_table_lookup(&t, events[i].pid) >= 0)
+			matched[0]++;
+	took[0] = now() - start;
+
+	start = now();
+	for (int i = 0; i < NUM_EVENTS; i++)
+		if (scan_ids(num_ids, ids, events[i].id) >= 0 &&
+		    scan_pids(num_pids, pids, events[i].pid) >= 0)
+			matched[1]++;
+	took[1] = now() - start;
+
+	check(matched[0] == matched[1], "%d pids, %d ids: %lld matched, "
+	      "scanning matched %lld", num_pids, num_ids, matched[0], matched[1]);
+	printf("%5d pids %3d race points: %6.2f ns/event, scan %6.2f ns/event\n",
+	       num_pids, num_ids, (double)took[0] / NUM_EVENTS,
+	       (double)took[1] / NUM_EVENTS);
+out:
+	pid_table_free(&t);
+	id_index_free(&x);
+	free(events);
+}
+
+int main(void) {
+	static const int num_pids[] = { 2, 8, 64, 256 };
+	static const int num_ids[] = { 2, 8, 16 };
+
+	check_pids();
+	check_ids();
+	srand(1);
+	for (int i = 0; i < (int)(sizeof(num_pids) / sizeof(num_pids[0])); i++)
+		for (int j = 0; j < (int)(sizeof(num_ids) / sizeof(num_ids[0])); j++)
+			bench(num_pids[i], num_ids[j]);
+	return failed;
+}
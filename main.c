@@ -9,19 +9,36 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "data.h"
+#include "delay.h"
 #include "k-race.h"
+#include "record.h"
 #include "stats.h"
+#include "sync.h"
 #include "trace.h"
 
 enum opts {
 	opt_config_file = 200,
+	opt_spin_only,
+	opt_absolute_start,
+	opt_processes,
+	opt_shards,
+	opt_free_running,
+	opt_subbuf_size_kb,
+	opt_bpf,
+	opt_perf,
+	opt_record,
 };
 
 static struct option long_opts[] = {
@@ -29,6 +46,15 @@ static struct option long_opts[] = {
 	{"out-file", required_argument, 0, 'o'},
 	{"explore-probability", required_argument, 0, 'e'},
 	{"no-trace", no_argument, 0, 'n'},
+	{"spin-only", no_argument, 0, opt_spin_only},
+	{"absolute-start", no_argument, 0, opt_absolute_start},
+	{"processes", no_argument, 0, opt_processes},
+	{"shards", required_argument, 0, opt_shards},
+	{"free-running", no_argument, 0, opt_free_running},
+	{"subbuf-size-kb", required_argument, 0, opt_subbuf_size_kb},
+	{"bpf", no_argument, 0, opt_bpf},
+	{"perf", no_argument, 0, opt_perf},
+	{"record", required_argument, 0, opt_record},
 	{0, 0, 0, 0},
 };
 
@@ -38,8 +64,17 @@ int k_race_parse_options(struct k_race_options *opts,
 	int explore_set = 0;
 
 	opts->notrace = 0;
+	opts->spin_only = 0;
+	opts->absolute_start = 0;
+	opts->processes = 0;
+	opts->shards = 1;
+	opts->free_running = 0;
+	opts->subbuf_size_kb = 0;
+	opts->bpf = 0;
+	opts->perf = 0;
 	opts->config_file = "config.json";
 	opts->out_file = NULL;
+	opts->record_file = NULL;
 	opts->explore_probability = 0.1;
 
 	while ((opt = getopt_long(argc, argv, "e:no:", long_opts, NULL)) != -1) {
@@ -65,6 +100,41 @@ int k_race_parse_options(struct k_race_options *opts,
 		case opt_config_file:
 			opts->config_file = optarg;
 			break;
+		case opt_spin_only:
+			opts->spin_only = 1;
+			break;
+		case opt_absolute_start:
+			opts->absolute_start = 1;
+			break;
+		case opt_processes:
+			opts->processes = 1;
+			break;
+		case opt_free_running:
+			opts->free_running = 1;
+			break;
+		case opt_shards:
+			opts->shards = strtol(optarg, &end, 10);
+			if (*end || opts->shards < 1) {
+				fprintf(stderr, "Bad --shards argument: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case opt_bpf:
+			opts->bpf = 1;
+			break;
+		case opt_perf:
+			opts->perf = 1;
+			break;
+		case opt_record:
+			opts->record_file = optarg;
+			break;
+		case opt_subbuf_size_kb:
+			opts->subbuf_size_kb = strtol(optarg, &end, 10);
+			if (*end || opts->subbuf_size_kb < 1) {
+				fprintf(stderr, "Bad --subbuf-size-kb argument: %s\n", optarg);
+				return -1;
+			}
+			break;
 		}
 	}
 
@@ -76,6 +146,42 @@ int k_race_parse_options(struct k_race_options *opts,
 		fprintf(stderr, "--out-file and --no-trace both given, but there is no output with --no-trace\n");
 		return -1;
 	}
+	if (opts->subbuf_size_kb && opts->notrace) {
+		fprintf(stderr, "--subbuf-size-kb does nothing with --no-trace\n");
+		return -1;
+	}
+	if (opts->bpf && opts->notrace) {
+		fprintf(stderr, "--bpf and --no-trace both given\n");
+		return -1;
+	}
+	if (opts->bpf && opts->subbuf_size_kb) {
+		fprintf(stderr, "--subbuf-size-kb does nothing with --bpf\n");
+		return -1;
+	}
+	if (opts->record_file && opts->notrace) {
+		fprintf(stderr, "--record and --no-trace both given, but there are no events with --no-trace\n");
+		return -1;
+	}
+	if (opts->record_file && opts->bpf) {
+		fprintf(stderr, "--record doesn't work with --bpf, which never sees individual events\n");
+		return -1;
+	}
+	if (opts->perf && opts->notrace) {
+		fprintf(stderr, "--perf and --no-trace both given\n");
+		return -1;
+	}
+	if (opts->perf && opts->bpf) {
+		fprintf(stderr, "--perf and --bpf both given\n");
+		return -1;
+	}
+	if (opts->perf && opts->subbuf_size_kb) {
+		fprintf(stderr, "--subbuf-size-kb does nothing with --perf\n");
+		return -1;
+	}
+	if (opts->free_running && opts->absolute_start) {
+		fprintf(stderr, "--absolute-start does nothing with --free-running\n");
+		return -1;
+	}
 	if (!opts->out_file)
 		opts->out_file = "out.dat";
 	return 0;
@@ -84,29 +190,98 @@ int k_race_parse_options(struct k_race_options *opts,
 struct worker {
 	struct worker_context *ctx;
 	struct k_race_target target;
-	long *duration;
-	struct timespec sleep_time;
+	// where and how this worker runs
+	struct k_race_sched_config sched;
+	long delay;
+	struct delay_calibration calibration;
+	// how long target.func takes, measured every round
+	struct quantile_sketch duration;
+	// when target.func was called in each of the last START_RING_SIZE
+	// rounds. Only this worker writes it, and only while nobody
+	// else is reading it between batches
+	long long *starts;
+	unsigned int num_starts;
+	// How far ahead the clock on this worker's CPU is, which
+	// worker_start() takes out of starts. 0 unless it's pinned to
+	// one CPU. See calibrate_skew().
+	long long skew;
+	// local sense for ctx->barrier
+	int sense;
+	// last value of ctx->batch we saw
+	int batch;
+	// how many rounds this worker has started, for picking fixture slots
+	unsigned int round;
+	// only for thread workers
 	pthread_t thread;
 	pid_t pid;
-};
+} __cacheline_aligned;
+
+// must be a power of 2 and at least the number of rounds in a batch
+#define START_RING_SIZE 1024
 
+// With process workers, everything in here (and the workers and
+// their start rings) lives in memory shared with all of them.
 struct worker_context {
 	int num_workers;
+	int processes;
+	// size of the shared mapping this lives at the start of
+	size_t shared_size;
 	struct worker *workers;
-	long *durations;
 	void *user_context;
 	struct k_race_callbacks callbacks;
-	pthread_barrier_t barrier;
 	unsigned int samples;
-	int round_finished;
-	int round_pre;
-	int start;
-	int finished;
+	int spin_limit;
+	int absolute_start;
+	// no rounds, see k_race_options.free_running
+	int free_running;
+	// whether any target has a pre hook
+	int target_pre;
+	// see struct k_race_fixtures. slots is NULL if there are none.
+	struct k_race_fixtures fixtures;
+	char *slots;
+	size_t slot_size;
+	pthread_t fixture_thread;
+	int fixture_spin_limit;
+	// only touched by the fixture thread until it's been joined
+	unsigned int fixtures_prepared;
+	unsigned int fixtures_cleaned;
+	// how far in the future to put each round's epoch
+	long start_lead;
 	int stop;
 	int error;
-	pthread_cond_t wait_start;
-	pthread_cond_t wait_end;
-	pthread_mutex_t mutex;
+	// Everything below gets written by somebody every round or every
+	// batch, so keep each on its own cache line.
+	struct spin_barrier barrier;
+	// with absolute_start, worker i starts at epoch + durations[i].
+	// written by the last worker into the barrier
+	long long epoch __cacheline_aligned;
+	// number of workers that got to their start time too late this batch
+	int late_starts __cacheline_aligned;
+	int round_finished __cacheline_aligned;
+	// incremented by start_batch() to start a batch
+	struct sync_word batch __cacheline_aligned;
+	int finished __cacheline_aligned;
+	// incremented by the last worker to finish a batch
+	struct sync_word batch_done __cacheline_aligned;
+	// number of workers that have started up and calibrated
+	struct sync_word ready __cacheline_aligned;
+	// number of fixture slots prepared so far
+	struct sync_word prepared __cacheline_aligned;
+	// number of rounds every worker is done with, if there are fixtures
+	struct sync_word rounds_done __cacheline_aligned;
+};
+
+// All the independent copies of the workers (see --shards). They run
+// their batches at the same time, each with its own offsets, and
+// share one set of duration estimates and one sampler.
+struct experiment {
+	int num_shards;
+	int num_workers;
+	struct worker_context **shards;
+	// per target, the longest any shard measured
+	long *durations;
+	// stopped because of SIGINT, see tracer_interrupted()
+	int interrupted;
 };
 
 static int set_sched_opts(pthread_attr_t *attr,
@@ -142,22 +317,30 @@ static int dummy_func(void *user, void *arg) { return 0; }
 
 static void stop_workers(struct worker_context *ctx) {
 	// can't exit yet because other threads might be
-	// in pthread_barrier_wait(). would take extra synchronization
+	// in spin_barrier_wait(). would take extra synchronization
 	// to exit now, so forget it and just set all funcs
 	// to dummy_func and finish getting the needed samples
-	for (int i = 0; i < ctx->num_workers; i++)
+	for (int i = 0; i < ctx->num_workers; i++) {
 		ctx->workers[i].target.func = dummy_func;
-	pthread_mutex_lock(&ctx->mutex);
-	ctx->stop = 1;
-	pthread_cond_broadcast(&ctx->wait_start);
-	pthread_cond_broadcast(&ctx->wait_end);
-	pthread_mutex_unlock(&ctx->mutex);
+		ctx->workers[i].target.pre = NULL;
+		ctx->workers[i].target.post = NULL;
+	}
+	__atomic_store_n(&ctx->stop, 1, __ATOMIC_RELEASE);
+	// wake up anybody waiting for a batch to start or finish,
+	// or on fixtures
+	sync_inc(&ctx->batch);
+	sync_inc(&ctx->batch_done);
+	sync_inc(&ctx->prepared);
+	sync_inc(&ctx->rounds_done);
 }
 
-static inline void pre_round(struct worker_context *ctx) {
-	if (ctx->callbacks.pre && !ctx->stop &&
-	    __atomic_add_fetch(&ctx->round_pre, 1, __ATOMIC_RELAXED) == ctx->num_workers) {
-		__atomic_store_n(&ctx->round_pre, 0, __ATOMIC_RELAXED);
+// called by the last worker into the barrier, before anybody leaves it
+static void run_pre(void *p) {
+	struct worker_context *ctx = p;
+
+	if (ctx->stop)
+		return;
+	if (ctx->callbacks.pre) {
 		int err = ctx->callbacks.pre(ctx->user_context);
 		if (err) {
 			fprintf(stderr, "Pre callback failed\n");
@@ -165,17 +348,44 @@ static inline void pre_round(struct worker_context *ctx) {
 			stop_workers(ctx);
 		}
 	}
+	// after pre() so it doesn't eat into the lead time
+	if (ctx->absolute_start)
+		ctx->epoch = delay_now() + ctx->start_lead;
+}
+
+static inline void pre_round(struct worker_context *ctx,
+			     struct worker *worker) {
+	spin_barrier_wait(&ctx->barrier, &worker->sense,
+			  ctx->callbacks.pre || ctx->absolute_start ?
+			  run_pre : NULL, ctx);
+}
 
-	pthread_barrier_wait(&ctx->barrier);
+// wait for this worker's turn to start the round
+static inline long long start_round(struct worker_context *ctx,
+				    struct worker *worker) {
+	if (!ctx->absolute_start)
+		return delay_ns(&worker->calibration, worker->delay);
+
+	long long deadline = ctx->epoch + worker->delay;
+	long long now = delay_until(&worker->calibration, deadline);
+	// delay_until() returns within a clock read or so of the deadline
+	// if it got there in time
+	if (__builtin_expect(now - deadline > 2 * worker->calibration.clock_cost, 0))
+		__atomic_add_fetch(&ctx->late_starts, 1, __ATOMIC_RELAXED);
+	return now;
 }
 
 static inline void post_round(struct worker_context *ctx) {
-	if (!ctx->callbacks.post || ctx->stop ||
-	    __atomic_add_fetch(&ctx->round_finished, 1, __ATOMIC_RELAXED) < ctx->num_workers)
+	if ((!ctx->callbacks.post && !ctx->slots) || ctx->stop ||
+	    __atomic_add_fetch(&ctx->round_finished, 1, __ATOMIC_ACQ_REL) < ctx->num_workers)
 		return;
 
 	__atomic_store_n(&ctx->round_finished, 0,
 			 __ATOMIC_RELAXED);
+	if (ctx->slots)
+		sync_inc(&ctx->rounds_done);
+	if (!ctx->callbacks.post)
+		return;
 	int err = ctx->callbacks.post(ctx->user_context);
 	if (err) {
 		fprintf(stderr, "Post callback failed\n");
@@ -184,76 +394,94 @@ static inline void post_round(struct worker_context *ctx) {
 	}
 }
 
-static int measure_duration(struct worker_context *ctx,
-			    struct worker *worker) {
-	int error = 0;
-	long first = 0, second = 0, third = 0;
-
-	for (int i = 0; i < 100; i++) {
-		struct timespec start, end;
-
-		// TODO: consider doing this as we go in worker_func().
-		// If the durations depend somehow on the offsets
-		// themselves, then we will not find that out here. e.g.
-		//
-		// func1() {
-		//   close(fd);
-		// }
-		//
-		// func2() {
-		//   int n = write(fd);
-		//   if (n > 0)
-		//     read(fd);
-		// }
-
-		pre_round(ctx);
-		clock_gettime(CLOCK_MONOTONIC, &start);
-		int err = worker->target.func(ctx->user_context,
-					      worker->target.arg);
-		clock_gettime(CLOCK_MONOTONIC, &end);
-		if (__builtin_expect(err, 0)) {
-			ctx->error = -1;
-			fprintf(stderr, "User funcion returned error: %d\n", err);
-			stop_workers(ctx);
-		}
-		post_round(ctx);
-
-		long duration = 1000000000 * (end.tv_sec - start.tv_sec);
-		if (end.tv_nsec > start.tv_nsec)
-			duration += end.tv_nsec - start.tv_nsec;
-		else
-			duration -= start.tv_nsec - end.tv_nsec;
-		if (duration > first) {
-			third = second;
-			second = first;
-			first = duration;
-		} else if (duration > second) {
-			third = second;
-			second = duration;
-		} else if (duration > third)
-			third = duration;
+static inline void target_hook(struct worker_context *ctx, void *arg,
+			       int (*hook)(void *, void *), const char *name) {
+	if (!hook)
+		return;
+	int err = hook(ctx->user_context, arg);
+	if (__builtin_expect(err, 0)) {
+		ctx->error = -1;
+		fprintf(stderr, "Target %s hook returned error: %d\n", name, err);
+		stop_workers(ctx);
 	}
-	*worker->duration = third;
-	return error;
 }
 
-static inline int wait_start(struct worker_context *ctx) {
-	pthread_mutex_lock(&ctx->mutex);
-	while (!ctx->start && !ctx->stop)
-		pthread_cond_wait(&ctx->wait_start, &ctx->mutex);
-	pthread_mutex_unlock(&ctx->mutex);
-	return !ctx->stop;
+static inline void *fixture_slot(struct worker_context *ctx, unsigned int seq) {
+	return ctx->slots + (seq % ctx->fixtures.num_slots) * ctx->slot_size;
+}
+
+// what to pass the target as arg this round
+static inline void *round_arg(struct worker_context *ctx,
+			      struct worker *worker) {
+	if (!ctx->slots)
+		return worker->target.arg;
+
+	unsigned int round = worker->round++;
+	int prepared;
+
+	// normally the slot has been ready for a while
+	while ((int)((prepared = __atomic_load_n(&ctx->prepared.val, __ATOMIC_ACQUIRE)) - round) <= 0 &&
+	       !__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+		sync_wait_change(&ctx->prepared, prepared, ctx->spin_limit);
+	return fixture_slot(ctx, round);
+}
+
+static inline int wait_start(struct worker_context *ctx,
+			     struct worker *worker) {
+	sync_wait_change(&ctx->batch, worker->batch, ctx->spin_limit);
+	worker->batch = __atomic_load_n(&ctx->batch.val, __ATOMIC_ACQUIRE);
+	return !__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE);
 }
 
 static inline void workers_finished(struct worker_context *ctx) {
-	pthread_mutex_lock(&ctx->mutex);
-	// OK because this function is only ever called after
-	// a pthread_barrier_wait() has happened since the last
-	// wait_start(), so nobody is still in that function
-	ctx->start = 0;
-	if (++ctx->finished == ctx->num_workers)
-		pthread_cond_signal(&ctx->wait_end);
-	pthread_mutex_unlock(&ctx->mutex);
+	if (__atomic_add_fetch(&ctx->finished, 1, __ATOMIC_ACQ_REL) == ctx->num_workers)
+		sync_inc(&ctx->batch_done);
+}
+
+static inline void record_call(struct worker_context *ctx, struct worker *worker,
+			       long long start, long long end, int err) {
+	sketch_add(&worker->duration, end - start);
+	worker->starts[worker->num_starts++ % START_RING_SIZE] = start;
+	if (__builtin_expect(err, 0)) {
+		ctx->error = -1;
+		fprintf(stderr, "User funcion returned error: %d\n", err);
+		stop_workers(ctx);
+	}
+}
+
+// With free_running, no barrier: just call the target over and over,
+// waiting worker->delay after each call.
+static void free_run(struct worker_context *ctx, struct worker *worker) {
+	void *arg = worker->target.arg;
+
+	for (int i = 0; i < ctx->samples; i++) {
+		target_hook(ctx, arg, worker->target.pre, "pre");
+		long long start = delay_now();
+		int err = worker->target.func(ctx->user_context, arg);
+		long long end = delay_now();
+		record_call(ctx, worker, start, end, err);
+		target_hook(ctx, arg, worker->target.post, "post");
+		delay_until(&worker->calibration, end + worker->delay);
+	}
+}
+
+static void run_rounds(struct worker_context *ctx, struct worker *worker) {
+	for (int i = 0; i < ctx->samples; i++) {
+		void *arg = round_arg(ctx, worker);
+
+		if (ctx->target_pre) {
+			// don't set up the next round while somebody
+			// might still be in the last one
+			spin_barrier_wait(&ctx->barrier, &worker->sense, NULL, NULL);
+			target_hook(ctx, arg, worker->target.pre, "pre");
+		}
+		pre_round(ctx, worker);
+		long long start = start_round(ctx, worker);
+		int err = worker->target.func(ctx->user_context, arg);
+		record_call(ctx, worker, start, delay_now(), err);
+		target_hook(ctx, arg, worker->target.post, "post");
+		post_round(ctx);
+	}
 }
 
 static void *worker_func(void *p) {
@@ -261,40 +489,143 @@ static void *worker_func(void *p) {
 	struct worker_context *ctx = worker->ctx;
 
 	worker->pid = syscall(__NR_gettid);
-
-	if (!wait_start(ctx))
-		return NULL;
-
-	int err = measure_duration(ctx, worker);
-	if (err)
-		return NULL;
-
-	workers_finished(ctx);
+	delay_calibrate(&worker->calibration);
+	sync_inc(&ctx->ready);
 
 	while (1) {
-		if (!wait_start(ctx))
+		if (!wait_start(ctx, worker))
 			return NULL;
 
-		for (int i = 0; i < ctx->samples; i++) {
-			pre_round(ctx);
-			nanosleep(&worker->sleep_time, NULL);
-			int err = worker->target.func(ctx->user_context,
-						      worker->target.arg);
-			if (__builtin_expect(err, 0)) {
-				ctx->error = -1;
-				fprintf(stderr, "User funcion returned error: %d\n", err);
-				stop_workers(ctx);
+		if (ctx->free_running)
+			free_run(ctx, worker);
+		else
+			run_rounds(ctx, worker);
+		workers_finished(ctx);
+	}
+	return NULL;
+}
+
+static int call_fixture(struct worker_context *ctx,
+			int (*f)(void *, void *), unsigned int seq,
+			const char *name) {
+	if (!f)
+		return 0;
+	int err = f(ctx->user_context, fixture_slot(ctx, seq));
+	if (err)
+		fprintf(stderr, "Fixture %s returned error: %d\n", name, err);
+	return err;
+}
+
+// Keeps up to num_slots fixtures prepared ahead of the workers, and
+// cleans each one up once the round that used it is over. Whatever is
+// left when we stop gets cleaned up in join_fixtures(), once nobody
+// can be using it anymore.
+static void *fixture_func(void *p) {
+	struct worker_context *ctx = p;
+	unsigned int prepared = 0, cleaned = 0;
+
+	while (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE)) {
+		if (prepared - cleaned == ctx->fixtures.num_slots) {
+			int done = __atomic_load_n(&ctx->rounds_done.val, __ATOMIC_ACQUIRE);
+
+			// stop_workers() bumps rounds_done too, and then
+			// done doesn't mean the round is really over
+			if (__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+				break;
+			if ((int)(done - cleaned) <= 0) {
+				sync_wait_change(&ctx->rounds_done, done,
+						 ctx->fixture_spin_limit);
+				continue;
 			}
-			post_round(ctx);
+			if (call_fixture(ctx, ctx->fixtures.cleanup, cleaned, "cleanup"))
+				goto err;
+			cleaned++;
+			continue;
 		}
-		workers_finished(ctx);
+		if (call_fixture(ctx, ctx->fixtures.prepare, prepared, "prepare"))
+			goto err;
+		prepared++;
+		sync_inc(&ctx->prepared);
 	}
+	goto out;
+
+err:
+	ctx->error = -1;
+	stop_workers(ctx);
+out:
+	ctx->fixtures_prepared = prepared;
+	ctx->fixtures_cleaned = cleaned;
 	return NULL;
 }
 
+static int start_fixtures(struct worker_context *ctx, cpu_set_t *spare) {
+	pthread_attr_t attr;
+
+	if (!ctx->slots)
+		return 0;
+	pthread_attr_init(&attr);
+	// with nowhere else to go, spinning would only get in the workers' way
+	if (CPU_COUNT(spare)) {
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), spare);
+		ctx->fixture_spin_limit = SYNC_SPIN_LIMIT;
+	}
+	int err = pthread_create(&ctx->fixture_thread, &attr, fixture_func, ctx);
+	pthread_attr_destroy(&attr);
+	if (err)
+		fprintf(stderr, "pthread create error: %s\n", strerror(err));
+	return err;
+}
+
+// only call once the workers are gone
+static int join_fixtures(struct worker_context *ctx) {
+	int ret = 0;
+
+	if (!ctx->fixture_thread)
+		return 0;
+	int err = pthread_join(ctx->fixture_thread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_join: %s\n", strerror(err));
+		return err;
+	}
+	for (; ctx->fixtures_cleaned != ctx->fixtures_prepared; ctx->fixtures_cleaned++)
+		if (call_fixture(ctx, ctx->fixtures.cleanup,
+				 ctx->fixtures_cleaned, "cleanup"))
+			ret = -1;
+	return ret;
+}
+
+static int wait_worker_process(struct worker *worker) {
+	int status;
+
+	if (waitpid(worker->pid, &status, 0) < 0) {
+		int err = errno;
+		fprintf(stderr, "waitpid(%d): %m\n", worker->pid);
+		return err;
+	}
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "worker process %d killed by signal %d\n",
+			worker->pid, WTERMSIG(status));
+		return EINTR;
+	}
+	if (WEXITSTATUS(status)) {
+		fprintf(stderr, "worker process %d exited with status %d\n",
+			worker->pid, WEXITSTATUS(status));
+		return ECHILD;
+	}
+	return 0;
+}
+
 static int join_workers(struct worker_context *ctx) {
 	int ret = 0;
 	for (int i = 0; i < ctx->num_workers; i++) {
+		if (ctx->processes) {
+			if (!ctx->workers[i].pid)
+				continue;
+			int err = wait_worker_process(&ctx->workers[i]);
+			if (err)
+				ret = err;
+			continue;
+		}
 		if (!ctx->workers[i].thread)
 			continue;
 
@@ -304,30 +635,147 @@ static int join_workers(struct worker_context *ctx) {
 			ret = err;
 		}
 	}
+	int err = join_fixtures(ctx);
+	if (err)
+		ret = err;
 	return ret;
 }
 
-static int run_workers(struct worker_context *ctx) {
-	pthread_mutex_lock(&ctx->mutex);
-	ctx->start = 1;
+#define MIN_START_LEAD 1000
+#define MAX_START_LEAD 1000000
+
+// Grow the epoch lead time quickly if more than 1% of starts were late,
+// and shrink it slowly otherwise, since a long lead just costs throughput.
+static void adjust_start_lead(struct worker_context *ctx) {
+	unsigned int late = __atomic_exchange_n(&ctx->late_starts, 0, __ATOMIC_RELAXED);
+
+	if (late * 100 > ctx->samples * ctx->num_workers)
+		ctx->start_lead *= 2;
+	else if (!late)
+		ctx->start_lead -= ctx->start_lead / 16;
+	if (ctx->start_lead < MIN_START_LEAD)
+		ctx->start_lead = MIN_START_LEAD;
+	if (ctx->start_lead > MAX_START_LEAD)
+		ctx->start_lead = MAX_START_LEAD;
+}
+
+// returns what to pass to finish_batch()
+static int start_batch(struct worker_context *ctx) {
+	int done = __atomic_load_n(&ctx->batch_done.val, __ATOMIC_ACQUIRE);
+
+	// OK because everybody incremented finished and then left
+	// workers_finished() before batch_done last changed
 	ctx->finished = 0;
 	ctx->error = 0;
-	pthread_cond_broadcast(&ctx->wait_start);
-	while (ctx->finished < ctx->num_workers && !ctx->stop)
-		pthread_cond_wait(&ctx->wait_end, &ctx->mutex);
-	pthread_mutex_unlock(&ctx->mutex);
+	sync_inc(&ctx->batch);
+	return done;
+}
+
+static int finish_batch(struct worker_context *ctx, int done) {
+	// stop_workers() also bumps batch_done, so this won't hang
+	sync_wait_change(&ctx->batch_done, done, ctx->spin_limit);
+	if (ctx->absolute_start)
+		adjust_start_lead(ctx);
+	return ctx->error;
+}
+
+static int set_process_sched_opts(struct k_race_sched_config *config) {
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &config->cpus)) {
+		perror("sched_setaffinity()");
+		return errno;
+	}
+	if (sched_setscheduler(0, config->sched_policy, &config->sched_param)) {
+		perror("sched_setscheduler()");
+		return errno;
+	}
+	return 0;
+}
+
+static int fork_worker(struct worker *worker) {
+	struct worker_context *ctx = worker->ctx;
+
+	// or else anything buffered shows up once per process
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) {
+		int err = errno;
+		perror("fork");
+		return err;
+	}
+	if (pid) {
+		worker->pid = pid;
+		return 0;
+	}
+
+	// Ctrl-C is for the parent, which cleans up tracing and then stops
+	// us between batches. Dying in the middle of one would leave it
+	// waiting for us.
+	signal(SIGINT, SIG_IGN);
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (set_process_sched_opts(&worker->sched)) {
+		ctx->error = -1;
+		stop_workers(ctx);
+		// start_workers() is waiting for everybody to show up
+		sync_inc(&ctx->ready);
+		_exit(1);
+	}
+	worker_func(worker);
+	_exit(0);
+}
+
+static int wait_ready(struct worker_context *ctx) {
+	int ready;
+
+	// make sure everybody's pid is filled in before the tracer wants it
+	while ((ready = __atomic_load_n(&ctx->ready.val, __ATOMIC_ACQUIRE)) < ctx->num_workers)
+		sync_wait_change(&ctx->ready, ready, ctx->spin_limit);
 	return ctx->error;
 }
 
-static int start_workers(struct worker_context *ctx,
-			 struct k_race_config *config) {
+static int start_worker_processes(struct worker_context *ctx) {
+	for (int i = 0; i < ctx->num_workers; i++) {
+		int err = fork_worker(&ctx->workers[i]);
+		if (err) {
+			stop_workers(ctx);
+			return err;
+		}
+	}
+	return wait_ready(ctx);
+}
+
+// Spinning while waiting on a worker that has to share our CPU just
+// keeps it from running, so don't unless told to.
+static void set_spin_limit(struct worker_context *ctx) {
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	for (int i = 0; i < ctx->num_workers; i++)
+		CPU_OR(&cpus, &cpus, &ctx->workers[i].sched.cpus);
+	if (ctx->spin_limit != SYNC_SPIN_FOREVER &&
+	    CPU_COUNT(&cpus) < ctx->num_workers)
+		ctx->spin_limit = 0;
+	ctx->barrier.spin_limit = ctx->spin_limit;
+}
+
+// spare is the CPUs no worker in any shard runs on
+static int start_workers(struct worker_context *ctx, cpu_set_t *spare) {
+	set_spin_limit(ctx);
+	if (ctx->processes)
+		return start_worker_processes(ctx);
+
+	// before the workers, so that the first slot is on its way
+	int err = start_fixtures(ctx, spare);
+	if (err) {
+		stop_workers(ctx);
+		return err;
+	}
+
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
 	for (int i = 0; i < ctx->num_workers; i++) {
-		struct k_race_sched_config *cfg = &config->sched_config[i];
 		struct worker *worker = &ctx->workers[i];
 
-		int err = set_sched_opts(&attr, cfg);
+		err = set_sched_opts(&attr, &worker->sched);
 		if (err) {
 			stop_workers(ctx);
 			pthread_attr_destroy(&attr);
@@ -343,121 +791,583 @@ static int start_workers(struct worker_context *ctx,
 		}
 	}
 	pthread_attr_destroy(&attr);
+	return wait_ready(ctx);
+}
 
-	return run_workers(ctx);
+// Give each worker its own CPU out of the ones its target is configured
+// for, so that shards don't get in each other's way. With one shard,
+// just use the config as is.
+static int assign_cpus(struct experiment *exp, struct k_race_config *config) {
+	cpu_set_t used;
+
+	CPU_ZERO(&used);
+	for (int s = 0; s < exp->num_shards; s++) {
+		for (int i = 0; i < exp->num_workers; i++) {
+			struct k_race_sched_config *cfg = &config->sched_config[i];
+			struct worker *worker = &exp->shards[s]->workers[i];
+			int cpu;
+
+			worker->sched = *cfg;
+			if (exp->num_shards == 1)
+				continue;
+
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &cfg->cpus) && !CPU_ISSET(cpu, &used))
+					break;
+			if (cpu == CPU_SETSIZE) {
+				fprintf(stderr, "Not enough CPUs for %d shards: none left "
+					"for target %d of shard %d\n", exp->num_shards, i, s);
+				return EINVAL;
+			}
+			CPU_SET(cpu, &used);
+			CPU_ZERO(&worker->sched.cpus);
+			CPU_SET(cpu, &worker->sched.cpus);
+		}
+	}
+	return 0;
+}
+
+static void stop_shards(struct experiment *exp) {
+	for (int s = 0; s < exp->num_shards; s++)
+		stop_workers(exp->shards[s]);
+}
+
+static void spare_cpus(struct experiment *exp, cpu_set_t *spare) {
+	if (sched_getaffinity(0, sizeof(*spare), spare)) {
+		CPU_ZERO(spare);
+		return;
+	}
+	for (int s = 0; s < exp->num_shards; s++) {
+		for (int i = 0; i < exp->num_workers; i++) {
+			cpu_set_t *cpus = &exp->shards[s]->workers[i].sched.cpus;
+
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, cpus))
+					CPU_CLR(cpu, spare);
+		}
+	}
+}
+
+static int start_shards(struct experiment *exp, struct k_race_config *config) {
+	cpu_set_t spare;
+	int err = assign_cpus(exp, config);
+	if (err) {
+		stop_shards(exp);
+		return err;
+	}
+	spare_cpus(exp, &spare);
+	for (int s = 0; s < exp->num_shards; s++) {
+		err = start_workers(exp->shards[s], &spare);
+		if (err) {
+			stop_shards(exp);
+			return err;
+		}
+	}
+	return 0;
+}
+
+// run one batch on every shard at once
+static int run_shards(struct experiment *exp) {
+	int done[exp->num_shards];
+	int ret = 0;
+
+	for (int s = 0; s < exp->num_shards; s++)
+		done[s] = start_batch(exp->shards[s]);
+	for (int s = 0; s < exp->num_shards; s++) {
+		int err = finish_batch(exp->shards[s], done[s]);
+		if (err)
+			ret = err;
+	}
+	return ret;
+}
+
+static void set_samples(struct experiment *exp, unsigned int samples) {
+	for (int s = 0; s < exp->num_shards; s++)
+		exp->shards[s]->samples = samples;
 }
 
 static void set_offsets(struct worker_context *ctx, const long *params) {
 	long min = 0;
-	ctx->durations[ctx->num_workers-1] = 0;
+	ctx->workers[ctx->num_workers-1].delay = 0;
 	for (int i = 0; i < ctx->num_workers-1; i++) {
-		ctx->durations[i] = params[i];
+		ctx->workers[i].delay = params[i];
 		if (params[i] < min) {
 			min = params[i];
 		}
 	}
-	for (int i = 0; i < ctx->num_workers; i++) {
-		ctx->durations[i] -= min;
-		ctx->workers[i].sleep_time.tv_sec = ctx->durations[i] / 1000000000;
-		ctx->workers[i].sleep_time.tv_nsec = ctx->durations[i] % 1000000000;
+	for (int i = 0; i < ctx->num_workers; i++)
+		ctx->workers[i].delay -= min;
+}
+
+// what quantile of the measured durations to use as "the" duration
+#define DURATION_QUANTILE 0.98
+// re-derive the sampler's parameter space when some duration
+// estimate moves by more than 1/DURATION_DRIFT of itself
+#define DURATION_DRIFT 4
+// start forgetting old measurements after this many
+#define DURATION_HISTORY 10000
+
+// Only call while the workers are waiting for a batch to start. Returns
+// 1 and updates exp->durations if the estimates drifted.
+static int update_durations(struct experiment *exp) {
+	int drifted = 0;
+	long estimates[exp->num_workers];
+
+	for (int i = 0; i < exp->num_workers; i++) {
+		long old = exp->durations[i];
+
+		// get_param_boundaries() doesn't like zero width
+		estimates[i] = 1;
+		for (int s = 0; s < exp->num_shards; s++) {
+			struct quantile_sketch *sketch = &exp->shards[s]->workers[i].duration;
+			long d = sketch_quantile(sketch, DURATION_QUANTILE);
+
+			if (d > estimates[i])
+				estimates[i] = d;
+			if (sketch->total > DURATION_HISTORY)
+				sketch_decay(sketch);
+		}
+		if (labs(estimates[i] - old) * DURATION_DRIFT > old)
+			drifted = 1;
 	}
+	if (drifted)
+		memcpy(exp->durations, estimates, sizeof(estimates));
+	return drifted;
+}
+
+static int track_durations(struct experiment *exp, struct sampler *sampler) {
+	if (!update_durations(exp))
+		return 0;
+	int err = sampler->update_durations(sampler, exp->durations);
+	if (err)
+		fprintf(stderr, "failed updating parameter space for new durations: %s\n",
+			strerror(err));
+	return err;
 }
 
 static int create_workers(void *context, int n,
 			  struct k_race_target *targets,
 			  struct k_race_options *opts,
 			  struct k_race_callbacks *callbacks,
-			  struct worker_context *ctx) {
-	memset(ctx, 0, sizeof(*ctx));
-	ctx->num_workers = n;
-	ctx->durations = malloc(sizeof(long) * n);
-	if (!ctx->durations)
-		return ENOMEM;
-	struct worker *workers = malloc(sizeof(struct worker) * n);
-	if (!workers) {
-		free(ctx->durations);
+			  struct worker_context **ctxp) {
+	// context, then workers, then each worker's start ring, all in one
+	// mapping so that process workers can share it
+	size_t ctx_size = (sizeof(struct worker_context) + CACHELINE_SIZE - 1) &
+		~(CACHELINE_SIZE - 1);
+	size_t size = ctx_size + sizeof(struct worker) * n +
+		sizeof(long long) * START_RING_SIZE * n;
+	struct worker_context *ctx = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ctx == MAP_FAILED) {
+		perror("mmap");
 		return ENOMEM;
 	}
-	memset(workers, 0, sizeof(struct worker) * n);
+
+	if (opts->free_running && callbacks &&
+	    (callbacks->pre || callbacks->post || callbacks->fixtures)) {
+		fprintf(stderr, "--free-running has no rounds to run pre and post "
+			"callbacks or fixtures around\n");
+		munmap(ctx, size);
+		return EINVAL;
+	}
+	if (callbacks && callbacks->fixtures) {
+		struct k_race_fixtures *fx = callbacks->fixtures;
+
+		if (opts->processes) {
+			fprintf(stderr, "Fixtures only work with thread workers\n");
+			munmap(ctx, size);
+			return EINVAL;
+		}
+		if (fx->num_slots < 1) {
+			fprintf(stderr, "Need at least one fixture slot\n");
+			munmap(ctx, size);
+			return EINVAL;
+		}
+		// each slot on its own cache lines
+		ctx->slot_size = (fx->slot_size + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1);
+		if (!ctx->slot_size)
+			ctx->slot_size = CACHELINE_SIZE;
+		ctx->slots = aligned_alloc(CACHELINE_SIZE, ctx->slot_size * fx->num_slots);
+		if (!ctx->slots) {
+			munmap(ctx, size);
+			return ENOMEM;
+		}
+		memset(ctx->slots, 0, ctx->slot_size * fx->num_slots);
+		ctx->fixtures = *fx;
+	}
+
+	ctx->shared_size = size;
+	ctx->num_workers = n;
+	ctx->processes = opts->processes;
+	ctx->spin_limit = opts->spin_only ? SYNC_SPIN_FOREVER : SYNC_SPIN_LIMIT;
+	ctx->absolute_start = opts->absolute_start;
+	ctx->free_running = opts->free_running;
+	// enough for a futex wakeup. adjust_start_lead() fixes it up
+	ctx->start_lead = 50000;
+	struct worker *workers = (struct worker *)((char *)ctx + ctx_size);
+	long long *starts = (long long *)(workers + n);
 	for (int i = 0; i < n; i++) {
 		workers[i].target = targets[i];
 		workers[i].ctx = ctx;
-		workers[i].duration = &ctx->durations[i];
+		sketch_init(&workers[i].duration);
+		if (targets[i].pre)
+			ctx->target_pre = 1;
+		workers[i].starts = starts + i * START_RING_SIZE;
 	}
 
 	ctx->user_context = context;
 	if (callbacks)
 		memcpy(&ctx->callbacks, callbacks, sizeof(*callbacks));
 	ctx->workers = workers;
-	pthread_barrier_init(&ctx->barrier, NULL, ctx->num_workers);
-	pthread_mutex_init(&ctx->mutex, NULL);
-	pthread_cond_init(&ctx->wait_start, NULL);
-	pthread_cond_init(&ctx->wait_end, NULL);
+	spin_barrier_init(&ctx->barrier, ctx->num_workers, ctx->spin_limit);
+	*ctxp = ctx;
 	return 0;
 }
 
 static void free_workers(struct worker_context *ctx) {
-	free(ctx->workers);
-	free(ctx->durations);
-	pthread_barrier_destroy(&ctx->barrier);
-	pthread_cond_destroy(&ctx->wait_start);
-	pthread_cond_destroy(&ctx->wait_end);
-	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx->slots);
+	munmap(ctx, ctx->shared_size);
 }
 
-static int print_data_header(FILE *out, uint32_t num_params, const char *name) {
-	char *magic = "k_race_data";
-	uint32_t np = htole32(num_params);
-
-	if (fputs(magic, out) == EOF)
-		return -1;
+// per-round results of the last batch
+struct round_results {
+	struct tracer_rounds rounds;
+	long long *starts;
+	int *counts;
+	int *triggers;
+	long long *near_misses;
+	// offsets round i actually ran with, num_params of them per round
+	long *achieved;
+};
 
-	if (fwrite(&np, sizeof(np), 1, out) != 1)
-		return -1;
+static int alloc_round_results(struct round_results *rr, int num_params) {
+	rr->starts = malloc(sizeof(long long) * START_RING_SIZE);
+	rr->counts = malloc(sizeof(int) * START_RING_SIZE);
+	rr->triggers = malloc(sizeof(int) * START_RING_SIZE);
+	rr->near_misses = malloc(sizeof(long long) * START_RING_SIZE);
+	rr->achieved = malloc(sizeof(long) * START_RING_SIZE * num_params);
+	if (!rr->starts || !rr->counts || !rr->triggers || !rr->near_misses ||
+	    !rr->achieved) {
+		free(rr->starts);
+		free(rr->counts);
+		free(rr->triggers);
+		free(rr->near_misses);
+		free(rr->achieved);
+		return ENOMEM;
+	}
+	rr->rounds.starts = rr->starts;
+	rr->rounds.counts = rr->counts;
+	rr->rounds.triggers = rr->triggers;
+	rr->rounds.near_misses = rr->near_misses;
 	return 0;
 }
 
-static int print_data(FILE *out, int n, uint64_t *params, uint32_t counts, uint32_t triggers) {
-	for (int i = 0; i < n; i++) {
-		uint64_t p = htole64(params[i]);
-		if (fwrite(&p, sizeof(p), 1, out) != 1)
-			return -1;
+static void free_round_results(struct round_results *rr) {
+	free(rr->starts);
+	free(rr->counts);
+	free(rr->triggers);
+	free(rr->near_misses);
+	free(rr->achieved);
+}
+
+static inline long long worker_start(struct worker_context *ctx,
+				     struct worker *worker, int round) {
+	return worker->starts[(worker->num_starts - ctx->samples + round) %
+			      START_RING_SIZE] - worker->skew;
+}
+
+// Only call while the workers are waiting for a batch to start. Fills
+// in when each round of the last batch started, and which offsets it
+// actually ran with. Params are relative to the last worker, like in
+// set_offsets().
+static void get_round_starts(struct worker_context *ctx, struct round_results *rr) {
+	int n = ctx->num_workers;
+
+	rr->rounds.num = ctx->samples;
+	for (int r = 0; r < ctx->samples; r++) {
+		long long last = worker_start(ctx, &ctx->workers[n-1], r);
+		long long first = last;
+		long *achieved = &rr->achieved[r * (n-1)];
+
+		for (int i = 0; i < n-1; i++) {
+			long long start = worker_start(ctx, &ctx->workers[i], r);
+			achieved[i] = start - last;
+			if (start < first)
+				first = start;
+		}
+		rr->starts[r] = first;
 	}
+}
 
-	counts = htole32(counts);
-	triggers = htole32(triggers);
-	if (fwrite(&counts, sizeof(counts), 1, out) != 1)
-		return -1;
-	if (fwrite(&triggers, sizeof(triggers), 1, out) != 1)
-		return -1;
+// With free_running there are no rounds as such, so make each call of
+// the last target a round, along with whichever call of each other
+// target started closest to it. This pairs up the calls by the start
+// times the workers took, rather than by the race points' timestamps.
+// A call made while some other target hadn't started calling yet, or
+// had already started its last call, has nothing to pair with, since
+// whichever worker is faster finishes its samples first, so those get
+// FREE_RUN_UNPAIRED offsets.
+static void get_free_run_starts(struct worker_context *ctx, struct round_results *rr) {
+	int n = ctx->num_workers;
+	int nearest[n-1];
+	long long prev = 0;
+
+	memset(nearest, 0, sizeof(nearest));
+	rr->rounds.num = ctx->samples;
+	for (int r = 0; r < ctx->samples; r++) {
+		long long last = worker_start(ctx, &ctx->workers[n-1], r);
+		long long first = last;
+		long *achieved = &rr->achieved[r * (n-1)];
+		int paired = 1;
+
+		for (int i = 0; i < n-1; i++) {
+			struct worker *w = &ctx->workers[i];
+			int j = nearest[i];
+
+			// both sorted, so the closest one only moves forward
+			while (j + 1 < ctx->samples &&
+			       llabs(worker_start(ctx, w, j+1) - last) <=
+			       llabs(worker_start(ctx, w, j) - last))
+				j++;
+			nearest[i] = j;
+
+			long long start = worker_start(ctx, w, j);
+			achieved[i] = start - last;
+			if (start < first)
+				first = start;
+			if (last < worker_start(ctx, w, 0) ||
+			    last > worker_start(ctx, w, ctx->samples - 1))
+				paired = 0;
+		}
+		if (!paired)
+			for (int i = 0; i < n-1; i++)
+				achieved[i] = FREE_RUN_UNPAIRED;
+		// find_round() needs these sorted
+		if (r > 0 && first < prev)
+			first = prev;
+		rr->starts[r] = prev = first;
+	}
+}
+
+// Credit each round's results to the offsets that round actually ran
+// with, and keep track of how far those were from what was requested.
+// With free_running, the sampler is steering the gaps between calls
+// rather than offsets, so it gets credited in experiment_loop() instead,
+// and what's interesting is which offsets the triggers happened at.
+static void report_rounds(struct worker_context *ctx, struct sampler *sampler,
+			  const long *requested, struct round_results *rr,
+			  uint32_t *jitter) {
+	int num_params = ctx->num_workers - 1;
+
+	for (int r = 0; r < rr->rounds.num; r++) {
+		long *achieved = &rr->achieved[r * num_params];
+
+		if (ctx->free_running) {
+			if (achieved[0] == FREE_RUN_UNPAIRED)
+				continue;
+			for (int t = 0; t < rr->triggers[r]; t++)
+				for (int i = 0; i < num_params; i++)
+					add_jitter(&jitter[i * JITTER_BINS], achieved[i],
+						   FREE_RUN_BIN_WIDTH);
+			continue;
+		}
+		for (int i = 0; i < num_params; i++)
+			add_jitter(&jitter[i * JITTER_BINS], achieved[i] - requested[i],
+				   JITTER_BIN_WIDTH);
+		if (sampler)
+			sampler->report_at(sampler, achieved, rr->counts[r],
+					   rr->triggers[r], rr->near_misses[r]);
+	}
+}
+
+// how often to redo calibrate_skew()
+#define SKEW_CALIBRATE_INTERVAL (60 * 1000000000LL)
+
+// Put the workers' start times in the same clock as the event
+// timestamps, which tracer_calibrate_skew() corrects to the first
+// traced CPU's. Only while the workers are waiting for a batch. If
+// they're spinning with a realtime priority, it can't get a thread on
+// their CPUs, and we just go on with the skews we had.
+static int calibrate_skew(struct experiment *exp, struct tracer *tr) {
+	int err = tracer_calibrate_skew(tr);
+	if (err == ETIMEDOUT) {
+		fprintf(stderr, "keeping the last clock skews\n");
+		return 0;
+	}
+	if (err)
+		return err;
+	for (int s = 0; s < exp->num_shards; s++) {
+		for (int i = 0; i < exp->num_workers; i++) {
+			struct worker *worker = &exp->shards[s]->workers[i];
+
+			worker->skew = 0;
+			if (CPU_COUNT(&worker->sched.cpus) != 1)
+				continue;
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &worker->sched.cpus)) {
+					worker->skew = tracer_cpu_skew(tr, cpu);
+					break;
+				}
+			}
+		}
+	}
 	return 0;
 }
 
-static int add_pids(struct tracer *tr, struct worker_context *ctx) {
-	for (int i = 0; i < ctx->num_workers; i++) {
-		int err = tracer_add_pid(tr, ctx->workers[i].pid);
-		if (err)
-			return err;
+// each shard is its own group
+static int add_pids(struct tracer *tr, struct experiment *exp) {
+	for (int s = 0; s < exp->num_shards; s++) {
+		struct worker_context *ctx = exp->shards[s];
+
+		for (int i = 0; i < ctx->num_workers; i++) {
+			int err = tracer_add_pid(tr, ctx->workers[i].pid, s);
+			if (err)
+				return err;
+		}
 	}
 	return 0;
 }
 
-static int adjust_samples(unsigned int *samples, unsigned int *overrun,
-			  unsigned int entries) {
+// Most samples a batch runs, which is also how many go into each set of
+// offsets before it's reported
+#define MAX_BATCH_SAMPLES 100
+#define MIN_BATCH_SAMPLES 2
+
+// After a clean batch: as many samples as the buffers have room for at
+// the rate that batch filled them, going by tracer_max_rounds().
+static unsigned int grow_samples(struct tracer *tr, unsigned int samples) {
+	int max = tracer_max_rounds(tr, samples);
+
+	if (max < 0 || max > MAX_BATCH_SAMPLES)
+		return MAX_BATCH_SAMPLES;
+	// it was clean, so don't go below what just worked
+	return max > samples ? max : samples;
+}
+
+static void print_lost_events(struct tracer *tr) {
+	int n = tracer_lost_events(tr, NULL, 0);
+	struct tracer_lost lost[n > 0 ? n : 1];
+
+	n = tracer_lost_events(tr, lost, n);
+	fprintf(stderr, "events lost so far:");
+	for (int i = 0; i < n; i++)
+		if (lost[i].lost)
+			fprintf(stderr, " %d: %llu", lost[i].id, lost[i].lost);
+	fprintf(stderr, "\n");
+}
+
+// After a batch that lost events: scale down by the fraction of them
+// that made it, with the same margin tracer_max_rounds() leaves.
+static int shrink_samples(struct tracer *tr, unsigned int *samples,
+			  unsigned int *overrun, unsigned int entries) {
 	unsigned int old_overrun = *overrun;
-	int err = ftrace_overrun(overrun);
+	int err = ftrace_overrun(tr, overrun);
 	if (err)
 		return err;
-	int s = *samples;
-	// TODO: do something better than that
-	*samples = entries * s/((*overrun - old_overrun + entries)*2);
+	unsigned long long lost = *overrun - old_overrun;
+	if (!lost && !entries)
+		return 0;
+	unsigned int s = (unsigned long long)*samples * entries / ((lost + entries) * 2);
+	if (s < MIN_BATCH_SAMPLES) {
+		if (*samples > MIN_BATCH_SAMPLES) {
+			fprintf(stderr, "ftrace buffers filling quickly. using %d samples per run. might be losing data\n",
+				MIN_BATCH_SAMPLES);
+			print_lost_events(tr);
+		}
+		s = MIN_BATCH_SAMPLES;
+	}
+	*samples = s;
 	return 0;
 }
 
-static int experiment_loop(struct worker_context *ctx,
+static struct recorder *open_recorder(struct experiment *exp,
+				      struct k_race_config *config,
+				      struct tracer *tr, const char *path,
+				      int per_round) {
+	int n = tracer_num_targets(tr);
+	char *points[config->num_race_points];
+	int groups[n > 0 ? n : 1];
+	struct record_header h = {
+		.num_points = config->num_race_points,
+		.points = points,
+		.num_shards = exp->num_shards,
+		.num_params = exp->num_workers - 1,
+		.free_running = exp->shards[0]->free_running,
+		.per_round = per_round,
+		.num_targets = n,
+		.groups = groups,
+	};
+
+	for (int i = 0; i < config->num_race_points; i++)
+		points[i] = (char *)config->race_points[i].description;
+	for (int i = 0; i < n; i++)
+		groups[i] = tracer_target_group(tr, i);
+	return recorder_open(path, &h);
+}
+
+// what experiment_loop() keeps track of for each shard
+struct shard_results {
+	// offsets the shard was asked to run with
+	long *params;
+	uint32_t *jitter;
+	struct round_results rr;
+	int counts;
+	int triggers;
+	long long near_miss;
+};
+
+// Keep going if this fails, like with out_file.
+static void record_batch(struct recorder *recorder, struct experiment *exp,
+			 struct shard_results *per_shard) {
+	struct record_shard shards[exp->num_shards];
+
+	for (int s = 0; s < exp->num_shards; s++) {
+		struct round_results *rr = &per_shard[s].rr;
+
+		shards[s].params = per_shard[s].params;
+		shards[s].num_rounds = rr->rounds.num;
+		shards[s].starts = rr->starts;
+		shards[s].achieved = rr->achieved;
+	}
+	recorder_write_batch(recorder, shards);
+}
+
+static int alloc_shard_results(struct shard_results *sr, int num_params) {
+	// zero for the first batch
+	sr->params = calloc(num_params, sizeof(long));
+	sr->jitter = malloc(sizeof(uint32_t) * JITTER_BINS * num_params);
+	if (!sr->params || !sr->jitter)
+		goto out_free;
+	if (alloc_round_results(&sr->rr, num_params))
+		goto out_free;
+	return 0;
+
+out_free:
+	free(sr->params);
+	free(sr->jitter);
+	sr->params = NULL;
+	sr->jitter = NULL;
+	return ENOMEM;
+}
+
+static void free_shard_results(struct shard_results *sr) {
+	if (!sr->params)
+		return;
+	free(sr->params);
+	free(sr->jitter);
+	free_round_results(&sr->rr);
+}
+
+static int experiment_loop(struct experiment *exp,
 			   struct k_race_config *config,
-			   float explore_probability, const char *out_file) {
-	struct tracer *tr = alloc_tracer(config);
+			   struct k_race_options *opts) {
+	struct tracer_options tr_opts = {
+		.num_groups = exp->num_shards,
+		.subbuf_size_kb = opts->subbuf_size_kb,
+		.bpf = opts->bpf,
+		.perf = opts->perf,
+	};
+	struct tracer *tr = alloc_tracer(config, &tr_opts);
 	if (!tr)
 		return ENOMEM;
 	int err = ftrace_init(tr);
@@ -465,123 +1375,313 @@ static int experiment_loop(struct worker_context *ctx,
 		goto out_free_tracer;
 
 	unsigned int overrun;
-	err = ftrace_overrun(&overrun);
+	err = ftrace_overrun(tr, &overrun);
 	if (err)
 		goto out_ftrace_exit;
 
-	err = start_workers(ctx, config);
+	err = start_shards(exp, config);
 	if (err)
 		goto out_ftrace_exit;
-	err = add_pids(tr, ctx);
+	err = add_pids(tr, exp);
 	if (err)
 		goto out_stop_workers;
-
-	struct sampler *sampler = alloc_learning_sampler(ctx->num_workers, ctx->durations, explore_probability);
-	if (!sampler)
+	err = calibrate_skew(exp, tr);
+	if (err)
+		goto out_stop_workers;
+	long long calibrated = delay_now();
+	// tracing stays on from here, with the collector thread keeping
+	// the buffers drained while batches run
+	cpu_set_t spare;
+	spare_cpus(exp, &spare);
+	err = tracer_start_collector(tr, &spare);
+	if (err)
+		goto out_stop_workers;
+	err = enable_tracing(tr);
+	if (err)
 		goto out_stop_workers;
 
-	FILE *out = fopen(out_file, "w");
+	int num_params = exp->num_workers - 1;
+	FILE *out = fopen(opts->out_file, "w");
 	if (!out) {
-		fprintf(stderr, "opening %s: %m\n", out_file);
-		goto out_destroy_sampler;
+		err = errno;
+		fprintf(stderr, "opening %s: %m\n", opts->out_file);
+		goto out_stop_workers;
 	}
-	err = print_data_header(out, sampler->num_params, config->name);
+	err = print_data_header(out, num_params, config->name,
+				exp->shards[0]->free_running);
 	if (err) {
-		fprintf(stderr, "writing to %s: %m\n", out_file);
+		fprintf(stderr, "writing to %s: %m\n", opts->out_file);
 		goto out_close_file;
 	}
 
-	ctx->samples = 100;
+	// The first batch runs with every offset zero, and that's where the
+	// initial duration estimates that the sampler is built from come from
+	struct sampler *sampler = NULL;
+	struct tracer_results *results = calloc(exp->num_shards, sizeof(*results));
+	if (!results) {
+		err = ENOMEM;
+		goto out_close_file;
+	}
+	struct shard_results *per_shard = calloc(exp->num_shards, sizeof(*per_shard));
+	if (!per_shard) {
+		err = ENOMEM;
+		goto out_free_results;
+	}
+	for (int s = 0; s < exp->num_shards; s++) {
+		err = alloc_shard_results(&per_shard[s], num_params);
+		if (err)
+			goto out_free_shards;
+	}
+	// if event timestamps can't be lined up with worker start times,
+	// all we can do is credit results to the requested offsets
+	int per_round = tracer_same_clock(tr);
+	unsigned int batch_samples = MAX_BATCH_SAMPLES;
+
+	struct recorder *recorder = NULL;
+	if (opts->record_file) {
+		recorder = open_recorder(exp, config, tr, opts->record_file, per_round);
+		if (!recorder) {
+			err = EIO;
+			goto out_free_shards;
+		}
+		tracer_set_event_hook(tr, recorder_event, recorder);
+	}
+
+	set_samples(exp, batch_samples);
 	while (1) {
 		unsigned int samples = 0;
-		int counts = 0, triggers = 0;
-		long *params = sampler->next_params(sampler);
 
-		set_offsets(ctx, params);
-		while (samples < 100) {
-			err = enable_tracing();
-			if (err)
-				goto out_close_file;
-			err = run_workers(ctx);
-			if (err)
-				goto out_close_file;
-			err = disable_tracing();
+		for (int s = 0; s < exp->num_shards; s++) {
+			struct shard_results *sr = &per_shard[s];
+
+			if (sampler)
+				memcpy(sr->params, sampler->next_params(sampler),
+				       sizeof(long) * num_params);
+			memset(sr->jitter, 0, sizeof(uint32_t) * JITTER_BINS * num_params);
+			sr->counts = 0;
+			sr->triggers = 0;
+			sr->near_miss = RACE_NO_NEAR_MISS;
+			set_offsets(exp->shards[s], sr->params);
+		}
+		while (samples < MAX_BATCH_SAMPLES) {
+			err = run_shards(exp);
 			if (err)
-				goto out_close_file;
-			int entries, _counts, _triggers;
-			int missed_events = tracer_collect_stats(tr, &entries, &_counts, &_triggers);
+				goto out_destroy_sampler;
+			if (tracer_interrupted(tr)) {
+				exp->interrupted = 1;
+				goto out_destroy_sampler;
+			}
+			// Everything the batch did happened before now. If the
+			// clocks don't match, there's nothing of ours in the
+			// buffers between batches anyway.
+			unsigned long long end = per_round ? delay_now() : TRACER_NO_END;
+			int entries;
+			for (int s = 0; s < exp->num_shards; s++) {
+				if (exp->shards[s]->free_running)
+					get_free_run_starts(exp->shards[s], &per_shard[s].rr);
+				else
+					get_round_starts(exp->shards[s], &per_shard[s].rr);
+				results[s].rounds = per_round ? &per_shard[s].rr.rounds : NULL;
+			}
+			int missed_events = tracer_collect_stats(tr, &entries, results, end);
+			unsigned int next_samples = batch_samples;
 			if (!missed_events) {
-				samples += ctx->samples;
-				counts += _counts;
-				triggers += _triggers;
-			} else if (ctx->samples > 2) {
-				err = adjust_samples(&ctx->samples, &overrun, entries);
+				samples += batch_samples;
+				// Make room for full batches if there isn't any
+				// yet. This only ever grows them, so it's a no-op
+				// once they're big enough.
+				err = tracer_fit_buffers(tr, batch_samples, MAX_BATCH_SAMPLES);
 				if (err)
-					goto out_close_file;
-				if (ctx->samples < 2) {
-					fprintf(stderr, "ftrace buffers filling quickly. using 2 samples per run. might be losing data\n");
-					ctx->samples = 2;
+					goto out_destroy_sampler;
+				next_samples = grow_samples(tr, batch_samples);
+				for (int s = 0; s < exp->num_shards; s++) {
+					struct shard_results *sr = &per_shard[s];
+
+					sr->counts += results[s].counts;
+					sr->triggers += results[s].triggers;
+					race_nearer(&sr->near_miss, results[s].near_miss);
+					// without per-round results, all free_running
+					// has to go on is the totals
+					if (per_round || !exp->shards[s]->free_running)
+						report_rounds(exp->shards[s], per_round ? sampler : NULL,
+							      sr->params, &sr->rr, sr->jitter);
 				}
+				if (recorder)
+					record_batch(recorder, exp, per_shard);
+			} else {
+				if (recorder)
+					recorder_drop_batch(recorder);
+				err = shrink_samples(tr, &next_samples, &overrun, entries);
+				if (err)
+					goto out_destroy_sampler;
+			}
+			if (next_samples != batch_samples) {
+				batch_samples = next_samples;
+				set_samples(exp, batch_samples);
 			}
 		}
-		sampler->report(sampler, counts, triggers);
-
-		/* Keep running if there's an error writing, since I guess you
-		could still trigger the race and get a splat or whatever
-		and that's what you really care about
-		*/
-		static int write_error;
-		if (!write_error) {
-			err = print_data(out, sampler->num_params, (uint64_t *)params, counts, triggers);
-			if (err) {
-				fprintf(stderr, "writing to %s: %m\n", out_file);
-				write_error = 1;
+
+		for (int s = 0; s < exp->num_shards; s++) {
+			struct shard_results *sr = &per_shard[s];
+
+			if (sampler && (!per_round || exp->shards[s]->free_running))
+				sampler->report_at(sampler, sr->params, sr->counts,
+						   sr->triggers, sr->near_miss);
+
+			/* Keep running if there's an error writing, since I guess you
+			could still trigger the race and get a splat or whatever
+			and that's what you really care about
+			*/
+			static int write_error;
+			if (!write_error) {
+				err = print_data(out, num_params, (uint64_t *)sr->params,
+						 sr->counts, sr->triggers, sr->near_miss,
+						 sr->jitter);
+				if (err) {
+					fprintf(stderr, "writing to %s: %m\n", opts->out_file);
+					write_error = 1;
+				}
 			}
 		}
+		if (recorder)
+			recorder_write_report(recorder);
+		// clocks drift apart
+		if (delay_now() - calibrated > SKEW_CALIBRATE_INTERVAL) {
+			err = calibrate_skew(exp, tr);
+			if (err)
+				goto out_destroy_sampler;
+			calibrated = delay_now();
+		}
+
+		if (sampler) {
+			err = track_durations(exp, sampler);
+			if (err)
+				goto out_destroy_sampler;
+			continue;
+		}
+		update_durations(exp);
+		sampler = alloc_learning_sampler(exp->num_workers, exp->durations, opts->explore_probability);
+		if (!sampler) {
+			err = ENOMEM;
+			goto out_destroy_sampler;
+		}
 	}
 
+out_destroy_sampler:
+	if (sampler)
+		sampler->destroy(sampler);
+	if (recorder) {
+		tracer_set_event_hook(tr, NULL, NULL);
+		recorder_close(recorder);
+	}
+out_free_shards:
+	for (int s = 0; s < exp->num_shards; s++)
+		free_shard_results(&per_shard[s]);
+	free(per_shard);
+out_free_results:
+	free(results);
 out_close_file:
 	fclose(out);
-out_destroy_sampler:
-	sampler->destroy(sampler);
 out_stop_workers:
-	stop_workers(ctx);
+	stop_shards(exp);
 out_ftrace_exit:
-	ftrace_exit();
+	ftrace_exit(tr);
 out_free_tracer:
 	free_tracer(tr);
 	return err;
 }
 
-static int notrace_loop(struct worker_context *ctx, struct k_race_config *config) {
-	int err = start_workers(ctx, config);
+static int notrace_loop(struct experiment *exp, struct k_race_config *config) {
+	int err = start_shards(exp, config);
 	if (err)
 		return err;
 
-	struct sampler *sampler = alloc_random_sampler(ctx->num_workers, ctx->durations);
-	if (!sampler) {
-		stop_workers(ctx);
-		return ENOMEM;
-	}
+	// like in experiment_loop(), the first batch is for measuring durations
+	struct sampler *sampler = NULL;
+	long zero_params[exp->num_workers - 1];
+	memset(zero_params, 0, sizeof(zero_params));
+	for (int s = 0; s < exp->num_shards; s++)
+		set_offsets(exp->shards[s], zero_params);
 
-	ctx->samples = 1000;
+	set_samples(exp, 1000);
 	while (1) {
-		set_offsets(ctx, sampler->next_params(sampler));
-		err = run_workers(ctx);
+		err = run_shards(exp);
 		if (err)
 			break;
+		if (sampler) {
+			err = track_durations(exp, sampler);
+			if (err)
+				break;
+		} else {
+			update_durations(exp);
+			sampler = alloc_random_sampler(exp->num_workers, exp->durations);
+			if (!sampler) {
+				err = ENOMEM;
+				break;
+			}
+		}
+		for (int s = 0; s < exp->num_shards; s++)
+			set_offsets(exp->shards[s], sampler->next_params(sampler));
 	}
 
-	sampler->destroy(sampler);
+	if (sampler)
+		sampler->destroy(sampler);
+	stop_shards(exp);
 	return err;
 }
 
+static void free_shards(struct experiment *exp) {
+	for (int s = 0; s < exp->num_shards; s++)
+		free_workers(exp->shards[s]);
+	free(exp->shards);
+	free(exp->durations);
+}
+
+// Each shard gets its own copy of the targets and its own user
+// context, from callbacks->init_shard() if there is one.
+static int create_shards(struct experiment *exp, void *user, int n,
+			 struct k_race_target *targets,
+			 struct k_race_options *opts,
+			 struct k_race_callbacks *callbacks) {
+	// callers that zeroed their options and never set shards get one
+	int num_shards = opts->shards > 1 ? opts->shards : 1;
+
+	exp->num_workers = n;
+	exp->num_shards = 0;
+	exp->durations = calloc(n, sizeof(long));
+	exp->shards = calloc(num_shards, sizeof(*exp->shards));
+	if (!exp->durations || !exp->shards) {
+		free_shards(exp);
+		return ENOMEM;
+	}
+
+	for (exp->num_shards = 0; exp->num_shards < num_shards; exp->num_shards++) {
+		struct k_race_target shard_targets[n];
+		void *shard_user = user;
+		int s = exp->num_shards;
+
+		memcpy(shard_targets, targets, sizeof(shard_targets));
+		if (callbacks && callbacks->init_shard &&
+		    callbacks->init_shard(s, shard_targets, &shard_user)) {
+			fprintf(stderr, "Setting up shard %d failed\n", s);
+			free_shards(exp);
+			return -1;
+		}
+		int err = create_workers(shard_user, n, shard_targets, opts,
+					 callbacks, &exp->shards[s]);
+		if (err) {
+			free_shards(exp);
+			return err;
+		}
+	}
+	return 0;
+}
+
 int k_race_loop(struct k_race_options *opts,
 		int num_targets, struct k_race_target *targets,
 		struct k_race_callbacks *callbacks, void *user) {
 	int err = -1;
-	int err2;
-	struct worker_context ctx;
+	struct experiment exp = {};
 
 	if (num_targets < 2) {
 		fprintf(stderr, "Must supply at least two targets\n");
@@ -594,21 +1694,26 @@ int k_race_loop(struct k_race_options *opts,
 	if (!config)
 		return ENOMEM;
 
-	if (create_workers(user, num_targets,
-			   targets, opts, callbacks, &ctx))
+	err = create_shards(&exp, user, num_targets, targets, opts, callbacks);
+	if (err)
 		goto out_config_free;
 
 	if (!opts->notrace)
-		err = experiment_loop(&ctx, config, opts->explore_probability, opts->out_file);
+		err = experiment_loop(&exp, config, opts);
 	else
-		err = notrace_loop(&ctx, config);
+		err = notrace_loop(&exp, config);
 
-	err2 = join_workers(&ctx);
-	if (!err)
-		err = err2;
-	free_workers(&ctx);
+	for (int s = 0; s < exp.num_shards; s++) {
+		int err2 = join_workers(exp.shards[s]);
+		if (!err)
+			err = err2;
+	}
+	free_shards(&exp);
 
 out_config_free:
 	k_race_config_free(config);
+	// everything's cleaned up, so let it do what it would have
+	if (exp.interrupted)
+		raise(SIGINT);
 	return err;
 }
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+// The --bpf backend: the same bookkeeping race_mark() in race.c
+// does, but done right in the kprobes so nothing has to go through the
+// ftrace ring buffers.
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "race_bpf_defs.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+// set before loading, indexed by the attach cookie
+const volatile struct race_bpf_point points[RACE_BPF_MAX_POINTS];
+const volatile int num_groups;
+
+// pid -> index into groups and open
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, RACE_BPF_MAX_TARGETS);
+	__type(key, __u32);
+	__type(value, __u32);
+} pids SEC(".maps");
+
+// filled in from userspace as pids are added
+int num_targets;
+int groups[RACE_BPF_MAX_TARGETS];
+int enabled;
+
+// both reset by userspace after every batch, once it has read results
+int open[RACE_BPF_MAX_TARGETS];
+struct race_bpf_counts results[RACE_BPF_MAX_GROUPS];
+
+static __always_inline void credit_group(int group, int trigger) {
+	if (group < 0 || group >= RACE_BPF_MAX_GROUPS)
+		return;
+	if (trigger)
+		__sync_fetch_and_add(&results[group].triggers, 1);
+	else
+		__sync_fetch_and_add(&results[group].counts, 1);
+}
+
+// like credit() in race.c
+static __always_inline void credit(int a, int b, int trigger) {
+	int group = a == RACE_BPF_ALL_GROUPS ? b : a;
+
+	if (b != RACE_BPF_ALL_GROUPS && b != group)
+		return;
+	if (group != RACE_BPF_ALL_GROUPS) {
+		credit_group(group, trigger);
+		return;
+	}
+	for (int i = 0; i < RACE_BPF_MAX_GROUPS && i < num_groups; i++)
+		credit_group(i, trigger);
+}
+
+SEC("kprobe")
+int race_point(struct pt_regs *ctx) {
+	__u64 point = bpf_get_attach_cookie(ctx);
+	__u32 pid = bpf_get_current_pid_tgid();
+
+	if (!enabled || point >= RACE_BPF_MAX_POINTS)
+		return 0;
+	__u32 *target = bpf_map_lookup_elem(&pids, &pid);
+	if (!target || *target >= RACE_BPF_MAX_TARGETS)
+		return 0;
+	__u32 from = *target;
+	int group = groups[from];
+
+	if (points[point].triggers) {
+		for (int i = 0; i < RACE_BPF_MAX_TARGETS && i < num_targets; i++)
+			if (i != from && open[i])
+				credit(groups[i], group, 1);
+	}
+	if (points[point].opens && !open[from]) {
+		open[from] = 1;
+		return 0;
+	}
+	if (points[point].closes && open[from]) {
+		credit(group, group, 0);
+		open[from] = 0;
+	}
+	return 0;
+}
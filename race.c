@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "race.h"
+
+int race_compile(struct race_data *race, const struct k_race_config *config,
+		 const int *point_map, int num_points) {
+	int n = 0;
+
+	race->num_points = num_points;
+	race->num_patterns = config->num_patterns;
+	race->patterns = calloc(config->num_patterns, sizeof(*race->patterns));
+	race->starts = calloc(num_points + 1, sizeof(*race->starts));
+	if (!race->patterns || !race->starts)
+		goto out_free;
+
+	for (int i = 0; i < config->num_patterns; i++) {
+		const struct k_race_pattern *kp = &config->patterns[i];
+		struct race_pattern *p = &race->patterns[i];
+
+		p->role = kp->role;
+		p->ordered = kp->ordered;
+		p->within = kp->within_ns;
+		p->all = kp->num_steps == 64 ? ~0ULL : (1ULL << kp->num_steps) - 1;
+		for (int j = 0; j < kp->num_steps; j++) {
+			int point = kp->steps[j].point;
+
+			race->starts[(point_map ? point_map[point] : point) + 1]++;
+			n++;
+		}
+	}
+	for (int i = 0; i < num_points; i++)
+		race->starts[i + 1] += race->starts[i];
+
+	race->transitions = malloc(sizeof(*race->transitions) * (n ? n : 1));
+	int *next = malloc(sizeof(int) * (num_points ? num_points : 1));
+	if (!race->transitions || !next) {
+		free(next);
+		goto out_free;
+	}
+	memcpy(next, race->starts, sizeof(int) * num_points);
+	// in pattern and step order, which race_mark() counts on
+	for (int i = 0; i < config->num_patterns; i++) {
+		const struct k_race_pattern *kp = &config->patterns[i];
+
+		for (int j = 0; j < kp->num_steps; j++) {
+			int point = kp->steps[j].point;
+			struct race_transition *t;
+
+			t = &race->transitions[next[point_map ? point_map[point] : point]++];
+			t->pattern = i;
+			t->step = j;
+			t->thread = kp->steps[j].thread;
+			if (kp->role == K_RACE_OPEN)
+				t->value = config->race_points[point].value_arg != NULL;
+			else
+				t->value = kp->steps[j].same_as_open != NULL;
+		}
+	}
+	free(next);
+	return 0;
+
+out_free:
+	free(race->patterns);
+	free(race->starts);
+	free(race->transitions);
+	race->patterns = NULL;
+	race->starts = NULL;
+	race->transitions = NULL;
+	return ENOMEM;
+}
+
+int race_add_target(struct race_data *race, unsigned long long pid, int group) {
+	struct race_status *s = realloc(race->statuses,
+					sizeof(*s) * (race->num_targets + 1));
+	if (!s)
+		return ENOMEM;
+	race->statuses = s;
+	s += race->num_targets;
+	memset(s, 0, sizeof(*s));
+	s->matches = calloc(race->num_patterns ? race->num_patterns : 1,
+			    sizeof(*s->matches));
+	if (!s->matches)
+		return ENOMEM;
+	s->pid = pid;
+	s->group = group;
+	race->num_targets++;
+	return 0;
+}
+
+int race_single_points(const struct race_data *race) {
+	for (int i = 0; i < race->num_patterns; i++)
+		if (race->patterns[i].all != 1)
+			return 0;
+	for (int i = 0; i < race->starts[race->num_points]; i++) {
+		const struct race_transition *t = &race->transitions[i];
+
+		if (t->value)
+			return 0;
+		if (race->patterns[t->pattern].role == K_RACE_TRIGGER &&
+		    t->thread != K_RACE_THREAD_OTHER)
+			return 0;
+	}
+	return 1;
+}
+
+void race_free(struct race_data *race) {
+	for (int i = 0; i < race->num_targets; i++)
+		free(race->statuses[i].matches);
+	free(race->statuses);
+	free(race->patterns);
+	free(race->starts);
+	free(race->transitions);
+}
+
+void race_start(struct race_data *race, struct tracer_results *results) {
+	race->results = results;
+	for (int i = 0; i < race->num_groups; i++) {
+		struct tracer_rounds *rounds = results[i].rounds;
+
+		results[i].counts = 0;
+		results[i].triggers = 0;
+		results[i].near_miss = RACE_NO_NEAR_MISS;
+		results[i].round = 0;
+		if (rounds) {
+			memset(rounds->counts, 0, sizeof(int) * rounds->num);
+			memset(rounds->triggers, 0, sizeof(int) * rounds->num);
+			for (int r = 0; r < rounds->num; r++)
+				rounds->near_misses[r] = RACE_NO_NEAR_MISS;
+		}
+	}
+	// near misses and half done patterns don't count across batches
+	for (int i = 0; i < race->num_targets; i++) {
+		struct race_status *status = &race->statuses[i];
+
+		status->closed = 0;
+		status->early = 0;
+		memset(status->matches, 0,
+		       sizeof(*status->matches) * race->num_patterns);
+	}
+}
+
+void race_nearer(long long *near_miss, long long d) {
+	if (llabs(d) < llabs(*near_miss))
+		*near_miss = d;
+}
+
+// move res->round up to the round that time falls in
+static void find_round(struct tracer_results *res, unsigned long long time) {
+	struct tracer_rounds *rounds = res->rounds;
+
+	while (res->round + 1 < rounds->num &&
+	       (long long)time >= rounds->starts[res->round + 1])
+		res->round++;
+}
+
+enum credit_kind {
+	CREDIT_COUNT,
+	CREDIT_TRIGGER,
+	CREDIT_NEAR_MISS,
+};
+
+static void credit_group(struct race_data *race, int group,
+			 unsigned long long time, enum credit_kind kind,
+			 long long miss) {
+	struct tracer_results *res = &race->results[group];
+
+	switch (kind) {
+	case CREDIT_COUNT:
+		res->counts++;
+		break;
+	case CREDIT_TRIGGER:
+		res->triggers++;
+		break;
+	case CREDIT_NEAR_MISS:
+		race_nearer(&res->near_miss, miss);
+		break;
+	}
+	if (!res->rounds)
+		return;
+	find_round(res, time);
+	switch (kind) {
+	case CREDIT_COUNT:
+		res->rounds->counts[res->round]++;
+		break;
+	case CREDIT_TRIGGER:
+		res->rounds->triggers[res->round]++;
+		break;
+	case CREDIT_NEAR_MISS:
+		race_nearer(&res->rounds->near_misses[res->round], miss);
+		break;
+	}
+}
+
+// Something involving targets a and b happened. Pids added with
+// TRACER_ALL_GROUPS take on the other one's group, and if they're
+// both like that, it goes to everybody.
+static int same_group(struct race_status *a, struct race_status *b) {
+	return a->group == TRACER_ALL_GROUPS || b->group == TRACER_ALL_GROUPS ||
+		a->group == b->group;
+}
+
+static void credit(struct race_data *race, struct race_status *a,
+		   struct race_status *b, unsigned long long time,
+		   enum credit_kind kind, long long miss) {
+	int group = a->group == TRACER_ALL_GROUPS ? b->group : a->group;
+
+	if (!same_group(a, b))
+		return;
+	if (group != TRACER_ALL_GROUPS) {
+		credit_group(race, group, time, kind, miss);
+		return;
+	}
+	for (int i = 0; i < race->num_groups; i++)
+		credit_group(race, i, time, kind, miss);
+}
+
+// Count a step of pattern p being hit at time, if it's the next one.
+static int advance(const struct race_pattern *p, struct race_match *m,
+		   int step, unsigned long long time) {
+	unsigned long long bit = 1ULL << step;
+
+	// too late to finish in time, so start over
+	if (m->matched && p->within && time - m->first > p->within)
+		m->matched = 0;
+	if (m->matched & bit)
+		return 0;
+	if (p->ordered && m->matched != bit - 1)
+		return 0;
+	if (!m->matched)
+		m->first = time;
+	m->matched |= bit;
+	return 1;
+}
+
+static int thread_matches(enum k_race_thread thread, struct race_status *status,
+			  struct race_status *from) {
+	switch (thread) {
+	case K_RACE_THREAD_SAME:
+		return status == from;
+	case K_RACE_THREAD_OTHER:
+		return status != from;
+	default:
+		return 1;
+	}
+}
+
+// forget how far along status is with patterns of role
+static void reset_matches(struct race_data *race, struct race_status *status,
+			  enum k_race_role role) {
+	for (int i = 0; i < race->num_patterns; i++)
+		if (race->patterns[i].role == role)
+			status->matches[i].matched = 0;
+}
+
+static void open_window(struct race_data *race, struct race_status *status,
+			unsigned long long time) {
+	status->open = 1;
+	if (status->early)
+		credit(race, status, &race->statuses[status->early_target],
+		       time, CREDIT_NEAR_MISS,
+		       -(long long)(time - status->early));
+	status->early = 0;
+	// triggers have to happen entirely inside
+	reset_matches(race, status, K_RACE_TRIGGER);
+	reset_matches(race, status, K_RACE_CLOSE);
+}
+
+static void close_window(struct race_data *race, struct race_status *status,
+			 unsigned long long time) {
+	credit(race, status, status, time, CREDIT_COUNT, 0);
+	status->open = 0;
+	status->closed = time;
+	reset_matches(race, status, K_RACE_OPEN);
+}
+
+// A trigger pattern that started at first finished at time, from target.
+static void trigger(struct race_data *race, struct race_status *status,
+		    int target, unsigned long long first,
+		    unsigned long long time) {
+	struct race_status *from = &race->statuses[target];
+
+	if (status->open) {
+		credit(race, status, from, time, CREDIT_TRIGGER, 0);
+		return;
+	}
+	// too late for the last window, and maybe too early for the next one
+	if (status->closed)
+		credit(race, status, from, time, CREDIT_NEAR_MISS,
+		       (long long)(time - status->closed));
+	status->early = first;
+	status->early_target = target;
+}
+
+void race_mark(struct race_data *race, int target, int point,
+	       unsigned long long time, unsigned long long value) {
+	struct race_status *from = &race->statuses[target];
+	int start = race->starts[point];
+	int end = race->starts[point + 1];
+
+	for (int i = 0; start < end && i < race->num_targets; i++) {
+		struct race_status *status = &race->statuses[i];
+		// one step per pattern, and one open or close, per event
+		int advanced = -1;
+		int toggled = 0;
+
+		for (int j = start; j < end; j++) {
+			struct race_transition *t = &race->transitions[j];
+			struct race_pattern *p = &race->patterns[t->pattern];
+			struct race_match *m = &status->matches[t->pattern];
+
+			if (t->pattern == advanced ||
+			    !thread_matches(t->thread, status, from))
+				continue;
+			switch (p->role) {
+			case K_RACE_OPEN:
+				if (status->open || toggled)
+					continue;
+				break;
+			case K_RACE_CLOSE:
+				if (!status->open || toggled)
+					continue;
+				break;
+			case K_RACE_TRIGGER:
+				// only windows opened in the same group count
+				if (!same_group(status, from))
+					continue;
+				break;
+			}
+			// compared to the last window's, once there's been one
+			if (t->value && p->role != K_RACE_OPEN &&
+			    ((!status->open && !status->closed) || status->value != value))
+				continue;
+			if (!advance(p, m, t->step, time))
+				continue;
+			advanced = t->pattern;
+			if (t->value && p->role == K_RACE_OPEN)
+				status->value = value;
+			if (m->matched != p->all)
+				continue;
+
+			m->matched = 0;
+			switch (p->role) {
+			case K_RACE_OPEN:
+				open_window(race, status, time);
+				toggled = 1;
+				break;
+			case K_RACE_CLOSE:
+				close_window(race, status, time);
+				toggled = 1;
+				break;
+			case K_RACE_TRIGGER:
+				trigger(race, status, target, m->first, time);
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,117 @@
+#ifndef RACE_H
+#define RACE_H
+
+#include <limits.h>
+
+#include "config.h"
+
+// Keeping track of race windows and crediting what happens in them,
+// for tracer_collect_stats() and for k-race-replay.
+
+// Pids added with this group are in every group. See tracer_results.
+#define TRACER_ALL_GROUPS -1
+
+// the near_miss of results that didn't have any
+#define RACE_NO_NEAR_MISS LLONG_MAX
+
+// For crediting results to individual rounds. starts[i] is when round
+// i started (DELAY_CLOCK time), and round i's results go in counts[i],
+// triggers[i] and near_misses[i].
+struct tracer_rounds {
+	int num;
+	const long long *starts;
+	int *counts;
+	int *triggers;
+	long long *near_misses;
+};
+
+// Results for one group of pids. A trigger only counts if the window
+// it lands in was opened by a pid in the same group.
+struct tracer_results {
+	int counts;
+	int triggers;
+	// Of the triggers that didn't land in a window, the one that came
+	// closest, in ns. Negative if it was that long before the window
+	// opened, positive if it was that long after it closed.
+	long long near_miss;
+	// may be NULL, and should be unless tracer_same_clock()
+	struct tracer_rounds *rounds;
+	// which round we're on, only used internally
+	int round;
+};
+
+// A struct k_race_pattern compiled for race_mark()
+struct race_pattern {
+	enum k_race_role role;
+	int ordered;
+	unsigned long long within;
+	// all the steps' bits
+	unsigned long long all;
+};
+
+// One step of a pattern, looked up by its race point
+struct race_transition {
+	int pattern;
+	int step;
+	enum k_race_thread thread;
+	// Opening steps with this set give the window the value they're hit
+	// with, and other steps only count when it's the same one.
+	int value;
+};
+
+struct race_data {
+	int num_targets;
+	struct race_status {
+		int open;
+		unsigned long long pid;
+		int group;
+		// when its window last closed, 0 if it hasn't yet
+		unsigned long long closed;
+		// The last trigger since then, if any, which missed this
+		// window by being too early once it opens.
+		unsigned long long early;
+		int early_target;
+		// what the opening steps carried, see race_transition.value
+		unsigned long long value;
+		// how far along each pattern is for this pid's window
+		struct race_match {
+			// bit i is set once step i has been hit
+			unsigned long long matched;
+			// when the first of them was
+			unsigned long long first;
+		} *matches;
+	} *statuses;
+	int num_groups;
+	int num_patterns;
+	struct race_pattern *patterns;
+	// Race point i's transitions are transitions[starts[i]] up to
+	// transitions[starts[i+1]], with each pattern's steps together and
+	// in order.
+	int num_points;
+	int *starts;
+	struct race_transition *transitions;
+	// where results go, one per group
+	struct tracer_results *results;
+};
+
+// Build the automaton for config's patterns, before adding any targets.
+// Config race point i is point_map[i] in race_mark(), or just i if
+// point_map is NULL, and there are num_points of those.
+int race_compile(struct race_data *race, const struct k_race_config *config,
+		 const int *point_map, int num_points);
+int race_add_target(struct race_data *race, unsigned long long pid, int group);
+// Whether every pattern is just one race point hit by another thread,
+// with nothing compared, the only thing --bpf knows how to count.
+int race_single_points(const struct race_data *race);
+void race_free(struct race_data *race);
+// Zero out results, which should have one entry per group with rounds
+// filled in, and credit everything from now on to them.
+void race_start(struct race_data *race, struct tracer_results *results);
+// Target hit point at time, carrying value if the point has a
+// k_race_point.value_arg. Call in time order.
+void race_mark(struct race_data *race, int target, int point,
+	       unsigned long long time, unsigned long long value);
+// set *near_miss to d if d is closer, see tracer_results.near_miss
+void race_nearer(long long *near_miss, long long d);
+
+#endif
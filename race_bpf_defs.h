@@ -0,0 +1,25 @@
+#ifndef RACE_BPF_DEFS_H
+#define RACE_BPF_DEFS_H
+
+// Shared between race.bpf.c and trace_bpf.c
+
+#include <linux/types.h>
+
+#define RACE_BPF_MAX_POINTS 16
+#define RACE_BPF_MAX_TARGETS 128
+#define RACE_BPF_MAX_GROUPS 32
+// same as TRACER_ALL_GROUPS
+#define RACE_BPF_ALL_GROUPS -1
+
+struct race_bpf_point {
+	int opens;
+	int triggers;
+	int closes;
+};
+
+struct race_bpf_counts {
+	__u64 counts;
+	__u64 triggers;
+};
+
+#endif
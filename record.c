@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "record.h"
+
+struct recorder {
+	FILE *f;
+	int num_shards;
+	int num_params;
+	// what's been credited since the last batch was written
+	int num_events;
+	int max_events;
+	struct tracer_event *events;
+	// set if the hook couldn't keep up, so the batch is incomplete
+	int oom;
+};
+
+static int put_u32(FILE *f, uint32_t v) {
+	v = htole32(v);
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -1;
+}
+
+static int put_u64(FILE *f, uint64_t v) {
+	v = htole64(v);
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -1;
+}
+
+static int get_u32(FILE *f, uint32_t *v) {
+	if (fread(v, sizeof(*v), 1, f) != 1)
+		return -1;
+	*v = le32toh(*v);
+	return 0;
+}
+
+static int get_u64(FILE *f, uint64_t *v) {
+	if (fread(v, sizeof(*v), 1, f) != 1)
+		return -1;
+	*v = le64toh(*v);
+	return 0;
+}
+
+static int write_header(FILE *f, const struct record_header *h) {
+	if (fputs(RECORD_MAGIC, f) == EOF || put_u32(f, RECORD_VERSION))
+		return -1;
+	if (put_u32(f, h->num_points))
+		return -1;
+	for (int i = 0; i < h->num_points; i++) {
+		uint32_t len = strlen(h->points[i]);
+
+		if (put_u32(f, len) || fwrite(h->points[i], 1, len, f) != len)
+			return -1;
+	}
+	if (put_u32(f, h->num_shards) || put_u32(f, h->num_params) ||
+	    put_u32(f, h->free_running) || put_u32(f, h->per_round) ||
+	    put_u32(f, h->num_targets))
+		return -1;
+	for (int i = 0; i < h->num_targets; i++)
+		if (put_u32(f, h->groups[i]))
+			return -1;
+	return 0;
+}
+
+struct recorder *recorder_open(const char *path, const struct record_header *h) {
+	struct recorder *r = calloc(1, sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return NULL;
+	}
+	r->num_shards = h->num_shards;
+	r->num_params = h->num_params;
+	r->f = fopen(path, "w");
+	if (!r->f) {
+		fprintf(stderr, "opening %s: %m\n", path);
+		free(r);
+		return NULL;
+	}
+	if (write_header(r->f, h)) {
+		fprintf(stderr, "writing to %s: %m\n", path);
+		fclose(r->f);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+int recorder_close(struct recorder *r) {
+	int err = 0;
+
+	if (fclose(r->f) == EOF) {
+		err = errno;
+		fprintf(stderr, "writing recording: %m\n");
+	}
+	free(r->events);
+	free(r);
+	return err;
+}
+
+void recorder_event(void *arg, const struct tracer_event *event) {
+	struct recorder *r = arg;
+
+	if (r->oom)
+		return;
+	if (r->num_events == r->max_events) {
+		int n = r->max_events ? 2 * r->max_events : 1024;
+		struct tracer_event *events = realloc(r->events, sizeof(*events) * n);
+		if (!events) {
+			fprintf(stderr, "%s: OOM\n", __func__);
+			r->oom = 1;
+			return;
+		}
+		r->events = events;
+		r->max_events = n;
+	}
+	r->events[r->num_events++] = *event;
+}
+
+void recorder_drop_batch(struct recorder *r) {
+	r->num_events = 0;
+	r->oom = 0;
+}
+
+int recorder_write_batch(struct recorder *r, const struct record_shard *shards) {
+	FILE *f = r->f;
+	int err = 0;
+
+	// better to leave it out than to replay half of it
+	if (r->oom)
+		goto out;
+	if (put_u32(f, RECORD_BATCH))
+		goto write_error;
+	for (int s = 0; s < r->num_shards; s++) {
+		const struct record_shard *sh = &shards[s];
+
+		for (int i = 0; i < r->num_params; i++)
+			if (put_u64(f, sh->params[i]))
+				goto write_error;
+		if (put_u32(f, sh->num_rounds))
+			goto write_error;
+		for (int i = 0; i < sh->num_rounds; i++) {
+			if (put_u64(f, sh->starts[i]))
+				goto write_error;
+			for (int j = 0; j < r->num_params; j++)
+				if (put_u64(f, sh->achieved[i * r->num_params + j]))
+					goto write_error;
+		}
+	}
+	if (put_u32(f, r->num_events))
+		goto write_error;
+	for (int i = 0; i < r->num_events; i++) {
+		struct tracer_event *e = &r->events[i];
+
+		if (put_u64(f, e->time) || put_u32(f, e->target) ||
+		    put_u32(f, e->point) || put_u64(f, e->value))
+			goto write_error;
+	}
+	goto out;
+
+write_error:
+	err = errno ? errno : EIO;
+	fprintf(stderr, "writing recording: %m\n");
+out:
+	recorder_drop_batch(r);
+	return err;
+}
+
+int recorder_write_report(struct recorder *r) {
+	// it's a good place to make sure things are on disk, since we
+	// tend to get killed with ^C
+	if (put_u32(r->f, RECORD_REPORT) || fflush(r->f) == EOF) {
+		fprintf(stderr, "writing recording: %m\n");
+		return errno ? errno : EIO;
+	}
+	return 0;
+}
+
+int record_read_header(FILE *f, struct record_header *h) {
+	char magic[sizeof(RECORD_MAGIC) - 1];
+	uint32_t version, v;
+
+	memset(h, 0, sizeof(*h));
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, RECORD_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "not a k-race recording\n");
+		return -1;
+	}
+	if (get_u32(f, &version) || version != RECORD_VERSION) {
+		fprintf(stderr, "unsupported recording version\n");
+		return -1;
+	}
+	if (get_u32(f, &v))
+		goto truncated;
+	h->points = calloc(v, sizeof(*h->points));
+	if (!h->points)
+		goto oom;
+	h->num_points = v;
+	for (int i = 0; i < h->num_points; i++) {
+		uint32_t len;
+
+		if (get_u32(f, &len))
+			goto truncated;
+		h->points[i] = malloc(len + 1);
+		if (!h->points[i])
+			goto oom;
+		if (fread(h->points[i], 1, len, f) != len)
+			goto truncated;
+		h->points[i][len] = '\0';
+	}
+	uint32_t shards, params, free_running, per_round, targets;
+	if (get_u32(f, &shards) || get_u32(f, &params) ||
+	    get_u32(f, &free_running) || get_u32(f, &per_round) ||
+	    get_u32(f, &targets))
+		goto truncated;
+	h->num_shards = shards;
+	h->num_params = params;
+	h->free_running = free_running;
+	h->per_round = per_round;
+	h->groups = malloc(sizeof(*h->groups) * (targets + 1));
+	if (!h->groups)
+		goto oom;
+	h->num_targets = targets;
+	for (int i = 0; i < h->num_targets; i++) {
+		if (get_u32(f, &v))
+			goto truncated;
+		h->groups[i] = (int32_t)v;
+	}
+	return 0;
+
+truncated:
+	fprintf(stderr, "recording is truncated\n");
+	record_free_header(h);
+	return -1;
+oom:
+	fprintf(stderr, "%s: OOM\n", __func__);
+	record_free_header(h);
+	return -1;
+}
+
+void record_free_header(struct record_header *h) {
+	for (int i = 0; i < h->num_points; i++)
+		free(h->points[i]);
+	free(h->points);
+	free(h->groups);
+	memset(h, 0, sizeof(*h));
+}
+
+static int read_shard(FILE *f, const struct record_header *h,
+		      struct record_shard *sh) {
+	uint64_t v;
+	uint32_t rounds;
+
+	sh->params = malloc(sizeof(*sh->params) * (h->num_params + 1));
+	if (!sh->params)
+		return ENOMEM;
+	for (int i = 0; i < h->num_params; i++) {
+		if (get_u64(f, &v))
+			return EIO;
+		sh->params[i] = (int64_t)v;
+	}
+	if (get_u32(f, &rounds))
+		return EIO;
+	sh->starts = malloc(sizeof(*sh->starts) * (rounds + 1));
+	sh->achieved = malloc(sizeof(*sh->achieved) * ((size_t)rounds * h->num_params + 1));
+	if (!sh->starts || !sh->achieved)
+		return ENOMEM;
+	sh->num_rounds = rounds;
+	for (int i = 0; i < sh->num_rounds; i++) {
+		if (get_u64(f, &v))
+			return EIO;
+		sh->starts[i] = (int64_t)v;
+		for (int j = 0; j < h->num_params; j++) {
+			if (get_u64(f, &v))
+				return EIO;
+			sh->achieved[i * h->num_params + j] = (int64_t)v;
+		}
+	}
+	return 0;
+}
+
+static int read_batch(FILE *f, const struct record_header *h,
+		      struct record_batch *batch) {
+	uint32_t n;
+	int err;
+
+	memset(batch, 0, sizeof(*batch));
+	batch->shards = calloc(h->num_shards, sizeof(*batch->shards));
+	if (!batch->shards)
+		return ENOMEM;
+	for (int s = 0; s < h->num_shards; s++) {
+		err = read_shard(f, h, &batch->shards[s]);
+		if (err)
+			return err;
+	}
+	if (get_u32(f, &n))
+		return EIO;
+	batch->events = malloc(sizeof(*batch->events) * (n + 1));
+	if (!batch->events)
+		return ENOMEM;
+	batch->num_events = n;
+	for (int i = 0; i < batch->num_events; i++) {
+		struct tracer_event *e = &batch->events[i];
+		uint64_t time, value;
+		uint32_t target, point;
+
+		if (get_u64(f, &time) || get_u32(f, &target) || get_u32(f, &point) ||
+		    get_u64(f, &value))
+			return EIO;
+		if (target >= h->num_targets || point >= h->num_points) {
+			fprintf(stderr, "bad event in recording\n");
+			return EINVAL;
+		}
+		e->time = time;
+		e->target = target;
+		e->point = point;
+		e->value = value;
+	}
+	return 0;
+}
+
+int record_read(FILE *f, const struct record_header *h,
+		struct record_batch *batch) {
+	uint32_t type;
+
+	if (get_u32(f, &type))
+		return feof(f) ? 0 : -1;
+	if (type == RECORD_REPORT)
+		return RECORD_REPORT;
+	if (type != RECORD_BATCH) {
+		fprintf(stderr, "unknown record type %u\n", type);
+		return -1;
+	}
+	int err = read_batch(f, h, batch);
+	if (err) {
+		if (err == ENOMEM)
+			fprintf(stderr, "%s: OOM\n", __func__);
+		else if (err == EIO)
+			fprintf(stderr, "recording is truncated\n");
+		record_free_batch(h, batch);
+		return -1;
+	}
+	return RECORD_BATCH;
+}
+
+void record_free_batch(const struct record_header *h,
+		       struct record_batch *batch) {
+	if (batch->shards) {
+		for (int s = 0; s < h->num_shards; s++) {
+			free(batch->shards[s].params);
+			free(batch->shards[s].starts);
+			free(batch->shards[s].achieved);
+		}
+	}
+	free(batch->shards);
+	free(batch->events);
+	memset(batch, 0, sizeof(*batch));
+}
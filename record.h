@@ -0,0 +1,76 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+
+#include "trace.h"
+
+// What --record saves: the race points and pids, and for every batch
+// whose results counted, the offsets each shard asked for, when its
+// rounds started and what offsets they got, and every event that got
+// credited, along with the arg value it carried. That's enough for
+// k-race-replay to credit the same events again with different roles
+// for the race points, without running anything. Everything's little endian, like the data file.
+
+#define RECORD_MAGIC "k_race_rec"
+#define RECORD_VERSION 2
+
+enum record_type {
+	RECORD_BATCH = 1,
+	// everything since the last one went into one entry per shard in
+	// the data file
+	RECORD_REPORT,
+};
+
+struct record_header {
+	int num_points;
+	// the config's race point descriptions
+	char **points;
+	int num_shards;
+	int num_params;
+	int free_running;
+	// whether events could be credited to rounds (tracer_same_clock())
+	int per_round;
+	int num_targets;
+	int *groups;
+};
+
+// one shard's part of a batch
+struct record_shard {
+	long *params;
+	int num_rounds;
+	long long *starts;
+	// num_params per round, like round_results.achieved
+	long *achieved;
+};
+
+struct record_batch {
+	// num_shards of them
+	struct record_shard *shards;
+	int num_events;
+	struct tracer_event *events;
+};
+
+struct recorder;
+
+// Returns NULL on error.
+struct recorder *recorder_open(const char *path, const struct record_header *h);
+int recorder_close(struct recorder *r);
+// for tracer_set_event_hook(), with the recorder as arg
+void recorder_event(void *arg, const struct tracer_event *event);
+// Write out the events since the last call along with shards, or throw
+// them away if the batch didn't count.
+int recorder_write_batch(struct recorder *r, const struct record_shard *shards);
+void recorder_drop_batch(struct recorder *r);
+int recorder_write_report(struct recorder *r);
+
+int record_read_header(FILE *f, struct record_header *h);
+void record_free_header(struct record_header *h);
+// Returns the type of the next record, filling in batch if it's
+// RECORD_BATCH, 0 at the end, or -1 on error.
+int record_read(FILE *f, const struct record_header *h,
+		struct record_batch *batch);
+void record_free_batch(const struct record_header *h,
+		       struct record_batch *batch);
+
+#endif
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+// k-race-replay: credit the events in a --record recording again, with
+// the race point roles from another config, and write the results out
+// like the run that made the recording would have. Every race point in
+// the new config has to have been in the recorded one, but each can
+// open, trigger or close something different now.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "data.h"
+#include "race.h"
+#include "record.h"
+
+static struct option long_opts[] = {
+	{"config-file", required_argument, 0, 'c'},
+	{"out-file", required_argument, 0, 'o'},
+	{0, 0, 0, 0},
+};
+
+// what's been credited to one shard since the last RECORD_REPORT
+struct replay_shard {
+	long *params;
+	int counts;
+	int triggers;
+	long long near_miss;
+	uint32_t *jitter;
+	struct tracer_rounds rounds;
+	int max_rounds;
+};
+
+struct replay {
+	struct record_header h;
+	// the new config's patterns, over the recorded race points
+	struct race_data race;
+	struct tracer_results *results;
+	struct replay_shard *shards;
+};
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [--config-file config.json] "
+		"[--out-file out.dat] recording\n", prog);
+}
+
+static int compile_race(struct replay *rp, struct k_race_config *config) {
+	int map[config->num_race_points];
+
+	for (int i = 0; i < config->num_race_points; i++) {
+		struct k_race_point *kp = &config->race_points[i];
+		int j;
+
+		for (j = 0; j < rp->h.num_points; j++)
+			if (!strcmp(rp->h.points[j], kp->description))
+				break;
+		if (j == rp->h.num_points) {
+			fprintf(stderr, "%s isn't in the recording\n", kp->description);
+			return EINVAL;
+		}
+		map[i] = j;
+	}
+	if (race_compile(&rp->race, config, map, rp->h.num_points))
+		goto oom;
+	for (int i = 0; i < rp->h.num_targets; i++)
+		if (race_add_target(&rp->race, 0, rp->h.groups[i]))
+			goto oom;
+	return 0;
+
+oom:
+	fprintf(stderr, "%s: OOM\n", __func__);
+	return ENOMEM;
+}
+
+static int alloc_replay(struct replay *rp) {
+	struct record_header *h = &rp->h;
+
+	rp->results = calloc(h->num_shards, sizeof(*rp->results));
+	rp->shards = calloc(h->num_shards, sizeof(*rp->shards));
+	if (!rp->results || !rp->shards)
+		return ENOMEM;
+	rp->race.num_groups = h->num_shards;
+
+	for (int s = 0; s < h->num_shards; s++) {
+		struct replay_shard *sh = &rp->shards[s];
+
+		sh->params = calloc(h->num_params + 1, sizeof(*sh->params));
+		sh->jitter = calloc((size_t)h->num_params * JITTER_BINS + 1,
+				    sizeof(*sh->jitter));
+		if (!sh->params || !sh->jitter)
+			return ENOMEM;
+		sh->near_miss = RACE_NO_NEAR_MISS;
+	}
+	return 0;
+}
+
+static void free_replay(struct replay *rp) {
+	if (rp->shards) {
+		for (int s = 0; s < rp->h.num_shards; s++) {
+			free(rp->shards[s].params);
+			free(rp->shards[s].jitter);
+			free(rp->shards[s].rounds.counts);
+			free(rp->shards[s].rounds.triggers);
+			free(rp->shards[s].rounds.near_misses);
+		}
+	}
+	free(rp->shards);
+	free(rp->results);
+	race_free(&rp->race);
+	record_free_header(&rp->h);
+}
+
+static int set_rounds(struct replay_shard *sh, const struct record_shard *rs) {
+	if (rs->num_rounds > sh->max_rounds) {
+		int *counts = realloc(sh->rounds.counts, sizeof(int) * rs->num_rounds);
+		if (!counts)
+			return ENOMEM;
+		sh->rounds.counts = counts;
+		int *triggers = realloc(sh->rounds.triggers, sizeof(int) * rs->num_rounds);
+		if (!triggers)
+			return ENOMEM;
+		sh->rounds.triggers = triggers;
+		long long *near_misses = realloc(sh->rounds.near_misses,
+						 sizeof(long long) * rs->num_rounds);
+		if (!near_misses)
+			return ENOMEM;
+		sh->rounds.near_misses = near_misses;
+		sh->max_rounds = rs->num_rounds;
+	}
+	sh->rounds.num = rs->num_rounds;
+	sh->rounds.starts = rs->starts;
+	return 0;
+}
+
+// Same as report_rounds() does in the live run, minus the sampler.
+static void add_round_jitter(struct replay *rp, struct replay_shard *sh,
+			     const struct record_shard *rs) {
+	int num_params = rp->h.num_params;
+
+	for (int r = 0; r < rs->num_rounds; r++) {
+		long *achieved = &rs->achieved[r * num_params];
+
+		if (rp->h.free_running) {
+			if (achieved[0] == FREE_RUN_UNPAIRED)
+				continue;
+			for (int t = 0; t < sh->rounds.triggers[r]; t++)
+				for (int i = 0; i < num_params; i++)
+					add_jitter(&sh->jitter[i * JITTER_BINS], achieved[i],
+						   FREE_RUN_BIN_WIDTH);
+			continue;
+		}
+		for (int i = 0; i < num_params; i++)
+			add_jitter(&sh->jitter[i * JITTER_BINS], achieved[i] - rs->params[i],
+				   JITTER_BIN_WIDTH);
+	}
+}
+
+static int replay_batch(struct replay *rp, struct record_batch *batch) {
+	struct record_header *h = &rp->h;
+
+	for (int s = 0; s < h->num_shards; s++) {
+		if (set_rounds(&rp->shards[s], &batch->shards[s]))
+			return ENOMEM;
+		rp->results[s].rounds = h->per_round ? &rp->shards[s].rounds : NULL;
+	}
+	race_start(&rp->race, rp->results);
+	for (int i = 0; i < batch->num_events; i++) {
+		struct tracer_event *e = &batch->events[i];
+
+		race_mark(&rp->race, e->target, e->point, e->time, e->value);
+	}
+	for (int s = 0; s < h->num_shards; s++) {
+		struct replay_shard *sh = &rp->shards[s];
+		struct record_shard *rs = &batch->shards[s];
+
+		memcpy(sh->params, rs->params, sizeof(long) * h->num_params);
+		sh->counts += rp->results[s].counts;
+		sh->triggers += rp->results[s].triggers;
+		race_nearer(&sh->near_miss, rp->results[s].near_miss);
+		if (h->per_round || !h->free_running)
+			add_round_jitter(rp, sh, rs);
+	}
+	return 0;
+}
+
+static int report(struct replay *rp, FILE *out) {
+	for (int s = 0; s < rp->h.num_shards; s++) {
+		struct replay_shard *sh = &rp->shards[s];
+
+		if (print_data(out, rp->h.num_params, (uint64_t *)sh->params,
+			       sh->counts, sh->triggers, sh->near_miss, sh->jitter))
+			return -1;
+		sh->counts = 0;
+		sh->triggers = 0;
+		sh->near_miss = RACE_NO_NEAR_MISS;
+		memset(sh->jitter, 0, sizeof(uint32_t) * JITTER_BINS * rp->h.num_params);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *config_file = "config.json";
+	const char *out_file = "out.dat";
+	struct replay rp;
+	int opt;
+	int ret = 1;
+
+	while ((opt = getopt_long(argc, argv, "c:o:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			config_file = optarg;
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[optind], "r");
+	if (!in) {
+		fprintf(stderr, "opening %s: %m\n", argv[optind]);
+		return 1;
+	}
+	memset(&rp, 0, sizeof(rp));
+	if (record_read_header(in, &rp.h))
+		goto out_close_in;
+	if (alloc_replay(&rp)) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		goto out_free_replay;
+	}
+	struct k_race_config *config = k_race_config_parse(rp.h.num_params + 1,
+							   config_file);
+	if (!config)
+		goto out_free_replay;
+	if (compile_race(&rp, config))
+		goto out_free_config;
+
+	FILE *out = fopen(out_file, "w");
+	if (!out) {
+		fprintf(stderr, "opening %s: %m\n", out_file);
+		goto out_free_config;
+	}
+	if (print_data_header(out, rp.h.num_params, config->name,
+			      rp.h.free_running))
+		goto write_error;
+
+	struct record_batch batch;
+	int type;
+	while ((type = record_read(in, &rp.h, &batch)) > 0) {
+		if (type == RECORD_REPORT) {
+			if (report(&rp, out))
+				goto write_error;
+			continue;
+		}
+		int err = replay_batch(&rp, &batch);
+		record_free_batch(&rp.h, &batch);
+		if (err) {
+			fprintf(stderr, "%s: OOM\n", __func__);
+			goto out_close_out;
+		}
+	}
+	if (type == 0)
+		ret = 0;
+	goto out_close_out;
+
+write_error:
+	fprintf(stderr, "writing to %s: %m\n", out_file);
+out_close_out:
+	if (fclose(out) == EOF) {
+		fprintf(stderr, "writing to %s: %m\n", out_file);
+		ret = 1;
+	}
+out_free_config:
+	k_race_config_free(config);
+out_free_replay:
+	free_replay(&rp);
+out_close_in:
+	fclose(in);
+	return ret;
+}
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "race.h"
 #include "stats.h"
 
 struct bucket {
@@ -21,11 +22,23 @@ struct bucket {
 struct learning_sampler {
 	int num_params;
 	long *params;
+	// the buckets split up [left_edges, right_edges) into a grid of
+	// cubes edge_length wide, dimension_num_buckets[i] of them along
+	// dimension i
+	long *left_edges;
+	long *right_edges;
+	long edge_length;
+	int *dimension_num_buckets;
+	int num_buckets;
 	struct bucket *buckets;
 	GTree *ordered_buckets;
 	struct bucket *current_bucket;
 	float explore_probability;
 	int found_something;
+	// Until something's found, where the closest near miss was and how
+	// close it got, so there's somewhere to look besides at random.
+	long *closest_params;
+	long long closest_miss;
 };
 
 static int bucket_cmp(const void *a, const void *b) {
@@ -94,13 +107,56 @@ static struct bucket *random_top_bucket(GTree *tree) {
 	return arg.bucket;
 }
 
+// returns NULL if point is outside of the grid
+static struct bucket *find_bucket(struct learning_sampler *ls, const long *point) {
+	int idx = 0;
+	int q = 1;
+
+	for (int j = 0; j < ls->num_params; j++) {
+		if (point[j] < ls->left_edges[j])
+			return NULL;
+		int i = (point[j] - ls->left_edges[j]) / ls->edge_length;
+		if (i >= ls->dimension_num_buckets[j])
+			return NULL;
+		idx += i * q;
+		q *= ls->dimension_num_buckets[j];
+	}
+	return &ls->buckets[idx];
+}
+
+// Pick params around the closest near miss, no further from it than it
+// missed by (plus a bucket, so it doesn't get stuck), so that closer
+// misses narrow the search down.
+static void near_closest_miss(struct sampler *s) {
+	struct learning_sampler *ls = s->private;
+	long long spread = ls->closest_miss + ls->edge_length;
+
+	for (int i = 0; i < ls->num_params; i++) {
+		long long r = (long long)random() << 31 | random();
+		long long p = ls->closest_params[i] + r % (2 * spread + 1) - spread;
+
+		if (p < ls->left_edges[i])
+			p = ls->left_edges[i];
+		if (p >= ls->right_edges[i])
+			p = ls->right_edges[i] - 1;
+		ls->params[i] = p;
+	}
+	ls->current_bucket = find_bucket(ls, ls->params);
+}
+
 static long *learning_next_params(struct sampler *s) {
 	struct learning_sampler *ls = s->private;
 
-	if (ls->found_something &&
-	    (float)random() / (float) RAND_MAX > ls->explore_probability) {
-		set_current_bucket(s, random_top_bucket(ls->ordered_buckets));
-		return ls->params;
+	if ((float)random() / (float) RAND_MAX > ls->explore_probability) {
+		if (ls->found_something) {
+			set_current_bucket(s, random_top_bucket(ls->ordered_buckets));
+			return ls->params;
+		}
+		if (ls->closest_miss != RACE_NO_NEAR_MISS) {
+			near_closest_miss(s);
+			if (ls->current_bucket)
+				return ls->params;
+		}
 	}
 
 	int idx = random() % g_tree_nnodes(ls->ordered_buckets);
@@ -108,23 +164,54 @@ static long *learning_next_params(struct sampler *s) {
 	return ls->params;
 }
 
-static void learning_report(struct sampler *s, int count, int triggers) {
-	if (count < 1)
+static void bucket_update(struct learning_sampler *ls, struct bucket *b,
+			  int count, float p) {
+	g_tree_steal(ls->ordered_buckets, b);
+	b->race_probability += ((p - b->race_probability) *
+				(float)count / (float)(count + b->count));
+	b->count += count;
+	g_tree_insert(ls->ordered_buckets, b, NULL);
+}
+
+static void add_near_miss(struct learning_sampler *ls, const long *params,
+			  long long near_miss) {
+	if (near_miss == RACE_NO_NEAR_MISS || llabs(near_miss) >= ls->closest_miss)
 		return;
+	ls->closest_miss = llabs(near_miss);
+	memcpy(ls->closest_params, params, sizeof(long) * ls->num_params);
+}
 
+static void learning_report(struct sampler *s, int count, int triggers,
+			    long long near_miss) {
 	struct learning_sampler *ls = s->private;
 
+	add_near_miss(ls, ls->params, near_miss);
+	if (count < 1)
+		return;
+
 	if (triggers > 0)
 		ls->found_something = 1;
 
-	float p = (float)triggers / (float)count;
-	struct bucket *b = ls->current_bucket;
+	bucket_update(ls, ls->current_bucket, count,
+		      (float)triggers / (float)count);
+}
+
+static void learning_report_at(struct sampler *s, const long *params,
+			       int count, int triggers, long long near_miss) {
+	struct learning_sampler *ls = s->private;
 
-	g_tree_steal(ls->ordered_buckets, b);
-	b->race_probability += ((p - b->race_probability) *
-				(float)count / (float)(count + b->count));
-	b->count += count;
-	g_tree_insert(ls->ordered_buckets, b, NULL);
+	add_near_miss(ls, params, near_miss);
+	if (count < 1)
+		return;
+
+	struct bucket *b = find_bucket(ls, params);
+	if (!b)
+		return;
+
+	if (triggers > 0)
+		ls->found_something = 1;
+
+	bucket_update(ls, b, count, (float)triggers / (float)count);
 }
 
 static void rand_init(void) {
@@ -143,16 +230,24 @@ static void rand_init(void) {
 	srandom(seed);
 }
 
-static void free_learning_sampler(struct sampler *s) {
-	struct learning_sampler *ls = s->private;
-	for (int i = 0; i < g_tree_nnodes(ls->ordered_buckets); i++) {
+static void free_buckets(struct learning_sampler *ls) {
+	for (int i = 0; i < ls->num_buckets; i++) {
 		struct bucket *b = &ls->buckets[i];
 		free(b->left_edges);
 		free(b->right_edges);
 	}
 	free(ls->buckets);
 	g_tree_unref(ls->ordered_buckets);
+	free(ls->dimension_num_buckets);
+	free(ls->left_edges);
+	free(ls->right_edges);
+}
+
+static void free_learning_sampler(struct sampler *s) {
+	struct learning_sampler *ls = s->private;
+	free_buckets(ls);
 	free(ls->params);
+	free(ls->closest_params);
 	free(ls);
 	free(s);
 }
@@ -167,6 +262,7 @@ static int get_param_boundaries(int num_dimensions, long *durations,
 	*right_edges = malloc(sizeof(long) * num_dimensions);
 	if (!*right_edges) {
 		fprintf(stderr, "%s out of memory\n", __func__);
+		free(*left_edges);
 		return -1;
 	}
 	for (int i = 0; i < num_dimensions; i++) {
@@ -183,7 +279,10 @@ static int get_param_boundaries(int num_dimensions, long *durations,
 }
 
 static struct sampler *alloc_sampler(int num_params, long *(*next_params)(struct sampler *),
-				     void (*destroy)(struct sampler *), void (*report)(struct sampler *, int, int),
+				     void (*destroy)(struct sampler *),
+				     void (*report)(struct sampler *, int, int, long long),
+				     void (*report_at)(struct sampler *, const long *, int, int, long long),
+				     int (*update_durations)(struct sampler *, long *),
 				     void *private) {
 	rand_init();
 
@@ -195,6 +294,8 @@ static struct sampler *alloc_sampler(int num_params, long *(*next_params)(struct
 	sampler->next_params = next_params;
 	sampler->destroy = destroy;
 	sampler->report = report;
+	sampler->report_at = report_at;
+	sampler->update_durations = update_durations;
 	sampler->private = private;
 	return sampler;
 }
@@ -317,103 +418,140 @@ static int get_bucket_shape(int num_dimensions, const long *left_edges, const lo
 	return 0;
 }
 
-// splits the possible params into different buckets, and then treats
-// the problem like a multi armed bandit
-struct sampler *alloc_learning_sampler(int num_funcs, long *durations,
-				       float explore_probability) {
-	struct learning_sampler *ls = malloc(sizeof(*ls));
-	if (!ls)
-		return NULL;
-
+// Lay out a fresh grid of empty buckets covering the parameter space
+// implied by durations
+static int init_buckets(struct learning_sampler *ls, long *durations) {
+	int num_dimensions = ls->num_params;
 	int err = ENOMEM;
-	int num_dimensions = num_funcs - 1;
 
-	ls->explore_probability = explore_probability;
-	ls->found_something = 0;
-
-	long *left_edges, *right_edges;
 	if (get_param_boundaries(num_dimensions, durations,
-				 &left_edges, &right_edges))
-		goto out_free_ls;
+				 &ls->left_edges, &ls->right_edges))
+		return ENOMEM;
 
-	int *dimension_num_buckets = malloc(sizeof(int) * num_dimensions);
-	if (!dimension_num_buckets) {
-		free(left_edges);
-		free(right_edges);
-		goto out_free_ls;
-	}
+	ls->dimension_num_buckets = malloc(sizeof(int) * num_dimensions);
+	if (!ls->dimension_num_buckets)
+		goto out_free_edges;
 
-	long edge_length;
-	int num_buckets;
-	err = get_bucket_shape(num_dimensions, left_edges, right_edges,
-			       &num_buckets, &edge_length, dimension_num_buckets);
-	if (err) {
-		free(dimension_num_buckets);
-		free(left_edges);
-		free(right_edges);
-		goto out_free_ls;
-	}
+	err = get_bucket_shape(num_dimensions, ls->left_edges, ls->right_edges,
+			       &ls->num_buckets, &ls->edge_length,
+			       ls->dimension_num_buckets);
+	if (err)
+		goto out_free_dimensions;
 
-	ls->buckets = malloc(sizeof(struct bucket) * num_buckets);
-	if (!ls->buckets) {
-		free(dimension_num_buckets);
-		free(left_edges);
-		free(right_edges);
-		goto out_free_ls;
-	}
-	memset(ls->buckets, 0, sizeof(struct bucket) * num_buckets);
+	err = ENOMEM;
+	ls->buckets = malloc(sizeof(struct bucket) * ls->num_buckets);
+	if (!ls->buckets)
+		goto out_free_dimensions;
+	memset(ls->buckets, 0, sizeof(struct bucket) * ls->num_buckets);
 
 	ls->ordered_buckets = g_tree_new(bucket_cmp);
-	ls->params = malloc(sizeof(long) * num_dimensions);
-	if (!ls->params) {
-		free(dimension_num_buckets);
-		free(left_edges);
-		free(right_edges);
-		goto out_free_tree;
-	}
 
-	for (int i = 0; i < num_buckets; i++) {
+	for (int i = 0; i < ls->num_buckets; i++) {
 		struct bucket *b = &ls->buckets[i];
 		b->left_edges = malloc(sizeof(long) * num_dimensions);
 		b->right_edges = malloc(sizeof(long) * num_dimensions);
-		if (!b->left_edges || !b->right_edges) {
-			free(left_edges);
-			free(right_edges);
-			free(dimension_num_buckets);
+		if (!b->left_edges || !b->right_edges)
 			goto out_free_buckets;
-		}
 		int q = 1;
 		for (int j = 0; j < num_dimensions; j++) {
-			int idx = i / q % dimension_num_buckets[j];
-			b->left_edges[j] = left_edges[j] + edge_length * idx;
-			b->right_edges[j] = b->left_edges[j] + edge_length;
-			q *= dimension_num_buckets[j];
+			int idx = i / q % ls->dimension_num_buckets[j];
+			b->left_edges[j] = ls->left_edges[j] + ls->edge_length * idx;
+			b->right_edges[j] = b->left_edges[j] + ls->edge_length;
+			q *= ls->dimension_num_buckets[j];
 		}
 		g_tree_insert(ls->ordered_buckets, b, NULL);
 	}
-
-	free(dimension_num_buckets);
-	free(left_edges);
-	free(right_edges);
-
-	struct sampler *s = alloc_sampler(num_dimensions, learning_next_params,
-					  free_learning_sampler, learning_report, ls);
-	if (!s)
-		goto out_free_buckets;
-	return s;
+	return 0;
 
 out_free_buckets:
-	for (int i = 0; i < num_buckets; i++) {
+	for (int i = 0; i < ls->num_buckets; i++) {
 		struct bucket *b = &ls->buckets[i];
 		if (b->left_edges)
 			free(b->left_edges);
 		if (b->right_edges)
 			free(b->right_edges);
 	}
-	free(ls->params);
-out_free_tree:
 	g_tree_unref(ls->ordered_buckets);
 	free(ls->buckets);
+out_free_dimensions:
+	free(ls->dimension_num_buckets);
+out_free_edges:
+	free(ls->left_edges);
+	free(ls->right_edges);
+	return err;
+}
+
+// Re-grid for new durations, carrying over what we learned in each old
+// bucket to whichever new bucket its center lands in.
+static int learning_update_durations(struct sampler *s, long *durations) {
+	struct learning_sampler *ls = s->private;
+	struct learning_sampler old = *ls;
+
+	int err = init_buckets(ls, durations);
+	if (err) {
+		*ls = old;
+		return err;
+	}
+
+	for (int i = 0; i < old.num_buckets; i++) {
+		struct bucket *b = &old.buckets[i];
+		if (!b->count)
+			continue;
+
+		// ls->params is only meaningful right after next_params()
+		for (int j = 0; j < ls->num_params; j++)
+			ls->params[j] = (b->left_edges[j] + b->right_edges[j]) / 2;
+		struct bucket *nb = find_bucket(ls, ls->params);
+		if (nb)
+			bucket_update(ls, nb, b->count, b->race_probability);
+	}
+	free_buckets(&old);
+	ls->current_bucket = NULL;
+	return 0;
+}
+
+// splits the possible params into different buckets, and then treats
+// the problem like a multi armed bandit
+struct sampler *alloc_learning_sampler(int num_funcs, long *durations,
+				       float explore_probability) {
+	struct learning_sampler *ls = malloc(sizeof(*ls));
+	if (!ls)
+		return NULL;
+
+	int err = ENOMEM;
+	int num_dimensions = num_funcs - 1;
+
+	ls->num_params = num_dimensions;
+	ls->explore_probability = explore_probability;
+	ls->found_something = 0;
+	ls->current_bucket = NULL;
+	ls->closest_miss = RACE_NO_NEAR_MISS;
+
+	ls->params = malloc(sizeof(long) * num_dimensions);
+	if (!ls->params)
+		goto out_free_ls;
+	ls->closest_params = malloc(sizeof(long) * num_dimensions);
+	if (!ls->closest_params)
+		goto out_free_params;
+
+	err = init_buckets(ls, durations);
+	if (err)
+		goto out_free_params;
+
+	struct sampler *s = alloc_sampler(num_dimensions, learning_next_params,
+					  free_learning_sampler, learning_report,
+					  learning_report_at, learning_update_durations, ls);
+	if (!s) {
+		err = ENOMEM;
+		goto out_free_buckets;
+	}
+	return s;
+
+out_free_buckets:
+	free_buckets(ls);
+out_free_params:
+	free(ls->params);
+	free(ls->closest_params);
 out_free_ls:
 	free(ls);
 	if (err == ENOMEM)
@@ -435,7 +573,25 @@ static long *random_next_params(struct sampler *s) {
 	return rs->params;
 }
 
-static void random_report(struct sampler *s, int foo, int bar) {}
+static void random_report(struct sampler *s, int foo, int bar,
+			  long long baz) {}
+
+static void random_report_at(struct sampler *s, const long *params,
+			     int foo, int bar, long long baz) {}
+
+static int random_update_durations(struct sampler *s, long *durations) {
+	struct random_sampler *rs = s->private;
+	long *left_edges, *right_edges;
+
+	if (get_param_boundaries(s->num_params, durations,
+				 &left_edges, &right_edges))
+		return ENOMEM;
+	free(rs->left_edges);
+	free(rs->right_edges);
+	rs->left_edges = left_edges;
+	rs->right_edges = right_edges;
+	return 0;
+}
 
 static void random_destroy(struct sampler *s) {
 	struct random_sampler *rs = s->private;
@@ -463,7 +619,8 @@ struct sampler *alloc_random_sampler(int num_funcs, long *durations) {
 		goto free_edges;
 
 	struct sampler *s = alloc_sampler(num_dimensions, random_next_params,
-					  random_destroy, random_report, rs);
+					  random_destroy, random_report, random_report_at,
+					  random_update_durations, rs);
 	if (!s)
 		goto free_params;
 	return s;
@@ -476,3 +633,54 @@ free_edges:
 	free(rs);
 	return NULL;
 }
+
+void sketch_init(struct quantile_sketch *s) {
+	memset(s, 0, sizeof(*s));
+}
+
+static int sketch_index(long value) {
+	unsigned long long v = value > 0 ? value : 0;
+
+	if (v < (1 << SKETCH_SUB_BITS))
+		return v;
+	int e = 63 - __builtin_clzll(v);
+	return ((e - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) +
+		((v >> (e - SKETCH_SUB_BITS)) & ((1 << SKETCH_SUB_BITS) - 1));
+}
+
+static long sketch_bucket_max(int idx) {
+	if (idx < (1 << SKETCH_SUB_BITS))
+		return idx;
+	int shift = (idx >> SKETCH_SUB_BITS) - 1;
+	long sub = idx & ((1 << SKETCH_SUB_BITS) - 1);
+	return (((1L << SKETCH_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void sketch_add(struct quantile_sketch *s, long value) {
+	s->counts[sketch_index(value)]++;
+	s->total++;
+}
+
+long sketch_quantile(const struct quantile_sketch *s, double q) {
+	unsigned long target = q * s->total + 0.5;
+	unsigned long seen = 0;
+
+	if (!s->total)
+		return 0;
+	if (target < 1)
+		target = 1;
+	for (int i = 0; i < SKETCH_BUCKETS; i++) {
+		seen += s->counts[i];
+		if (seen >= target)
+			return sketch_bucket_max(i);
+	}
+	return sketch_bucket_max(SKETCH_BUCKETS - 1);
+}
+
+void sketch_decay(struct quantile_sketch *s) {
+	s->total = 0;
+	for (int i = 0; i < SKETCH_BUCKETS; i++) {
+		s->counts[i] /= 2;
+		s->total += s->counts[i];
+	}
+}
@@ -4,7 +4,17 @@
 struct sampler {
 	int num_params;
 	long *(*next_params)(struct sampler *s);
-	void (*report)(struct sampler *s, int counts, int triggers);
+	// near_miss is like tracer_results.near_miss, for getting close
+	// before anything actually triggers
+	void (*report)(struct sampler *s, int counts, int triggers,
+		       long long near_miss);
+	// Like report(), but for results that should be credited to
+	// params rather than to the last thing next_params() returned.
+	void (*report_at)(struct sampler *s, const long *params,
+			  int counts, int triggers, long long near_miss);
+	// Called when the estimated durations of the targets have moved
+	// enough that the parameter space should be re-derived.
+	int (*update_durations)(struct sampler *s, long *durations);
 	void (*destroy)(struct sampler *s);
 	void *private;
 };
@@ -15,4 +25,21 @@ struct sampler *alloc_learning_sampler(int num_dimensions, long *durations,
 				       float explore_probability);
 struct sampler *alloc_random_sampler(int num_dimensions, long *durations);
 
+// Streaming quantile estimate with about 3% relative error. Values are
+// bucketed by their top SKETCH_SUB_BITS + 1 significant bits.
+#define SKETCH_SUB_BITS 5
+#define SKETCH_BUCKETS ((64 - SKETCH_SUB_BITS) << SKETCH_SUB_BITS)
+
+struct quantile_sketch {
+	unsigned long total;
+	unsigned int counts[SKETCH_BUCKETS];
+};
+
+void sketch_init(struct quantile_sketch *s);
+void sketch_add(struct quantile_sketch *s, long value);
+// returns an upper bound on the q-th quantile, or 0 if nothing was added
+long sketch_quantile(const struct quantile_sketch *s, double q);
+// halve all counts, so that old values slowly stop mattering
+void sketch_decay(struct quantile_sketch *s);
+
 #endif
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "sync.h"
+
+static inline void futex_wait(int *addr, int val) {
+	if (syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0) &&
+	    errno != EAGAIN && errno != EINTR)
+		perror("futex(FUTEX_WAIT)");
+}
+
+static inline void futex_wake(int *addr) {
+	if (syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0)
+		perror("futex(FUTEX_WAKE)");
+}
+
+void sync_wait_change(struct sync_word *w, int old, int spin_limit) {
+	for (int i = 0; __atomic_load_n(&w->val, __ATOMIC_ACQUIRE) == old; i++) {
+		if (spin_limit < 0 || i < spin_limit) {
+			cpu_relax();
+			continue;
+		}
+		// Pairs with sync_set(). Either the setter sees our
+		// increment and wakes us, or the kernel sees the new
+		// value and doesn't put us to sleep.
+		__atomic_add_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+		futex_wait(&w->val, old);
+		__atomic_sub_fetch(&w->waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void sync_set(struct sync_word *w, int val) {
+	__atomic_store_n(&w->val, val, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&w->val);
+}
+
+void sync_inc(struct sync_word *w) {
+	__atomic_add_fetch(&w->val, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&w->val);
+}
+
+void spin_barrier_init(struct spin_barrier *b, int n, int spin_limit) {
+	b->count = 0;
+	b->sense.val = 0;
+	b->sense.waiters = 0;
+	b->n = n;
+	b->spin_limit = spin_limit;
+}
+
+int spin_barrier_wait(struct spin_barrier *b, int *local_sense,
+		      void (*last)(void *), void *arg) {
+	int sense = !*local_sense;
+
+	*local_sense = sense;
+	if (__atomic_add_fetch(&b->count, 1, __ATOMIC_ACQ_REL) == b->n) {
+		// nobody can touch count again until we flip the sense below
+		__atomic_store_n(&b->count, 0, __ATOMIC_RELAXED);
+		if (last)
+			last(arg);
+		sync_set(&b->sense, sense);
+		return 1;
+	}
+	sync_wait_change(&b->sense, !sense, b->spin_limit);
+	return 0;
+}
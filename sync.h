@@ -0,0 +1,57 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#define CACHELINE_SIZE 64
+#define __cacheline_aligned __attribute__((aligned(CACHELINE_SIZE)))
+
+// How many times to spin before falling back to sleeping in the kernel.
+// At ~40ns per pause on x86 this is on the order of a millisecond,
+// which is longer than a round but shorter than collecting a batch.
+#define SYNC_SPIN_LIMIT 20000
+// spin_limit value meaning never sleep
+#define SYNC_SPIN_FOREVER -1
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+// A word other threads can wait on changing. waiters is only touched
+// by threads that gave up spinning, so wakers can skip the syscall
+// when everybody is still spinning.
+//
+// None of this uses FUTEX_PRIVATE_FLAG, so it all works the same when
+// the words live in memory shared between processes.
+struct sync_word {
+	int val;
+	int waiters;
+};
+
+// wait for w->val to be something other than old
+void sync_wait_change(struct sync_word *w, int old, int spin_limit);
+// set w->val to val and wake up anybody waiting on it
+void sync_set(struct sync_word *w, int val);
+// same, but add one instead of setting it
+void sync_inc(struct sync_word *w);
+
+// Sense-reversing barrier. Each thread keeps its own local sense,
+// initialized to 0, and passes it to every spin_barrier_wait() call.
+struct spin_barrier {
+	int count __cacheline_aligned;
+	struct sync_word sense __cacheline_aligned;
+	int n;
+	int spin_limit;
+};
+
+void spin_barrier_init(struct spin_barrier *b, int n, int spin_limit);
+// The last thread to arrive calls last(arg) (if last isn't NULL) before
+// letting anybody else through, and gets 1 back. Everybody else gets 0.
+int spin_barrier_wait(struct spin_barrier *b, int *local_sense,
+		      void (*last)(void *), void *arg);
+
+#endif
@@ -6,10 +6,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <traceevent/event-parse.h>
 #include <traceevent/kbuffer.h>
@@ -17,9 +22,193 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "delay.h"
+#include "lookup.h"
+#include "race.h"
+#include "sync.h"
 #include "trace.h"
+#include "trace_bpf.h"
+#include "trace_perf.h"
+
+#if __has_include(<linux/trace_mmap.h>)
+#include <linux/trace_mmap.h>
+#else
+#include <linux/types.h>
+
+// from linux/trace_mmap.h, for building against older kernel headers
+struct trace_buffer_meta {
+	__u32 meta_page_size;
+	__u32 meta_struct_len;
+	__u32 subbuf_size;
+	__u32 nr_subbufs;
+	struct {
+		__u64 lost_events;
+		__u32 id;
+		__u32 read;
+	} reader;
+	__u64 flags;
+	__u64 entries;
+	__u64 overrun;
+	__u64 read;
+	__u64 Reserved1;
+	__u64 Reserved2;
+};
+#define TRACE_MMAP_IOCTL_GET_READER _IO('R', 0x20)
+#endif
+
+#define KPROBE_LENGTH 65
 
-static FILE *tracing_on;
+struct race_point {
+	char kprobe_type;
+	char kprobe_name[KPROBE_LENGTH];
+	char kprobe[KPROBE_LENGTH];
+	unsigned long long event_id;
+	// like in struct k_race_point, for --bpf
+	int opens;
+	int triggers;
+	int closes;
+	// These point into the config, which outlives us. See struct
+	// k_race_point.
+	const char *fetch_args;
+	const char *filter;
+	const char *value_arg;
+	// where value_arg is in the event, if it's set
+	int value_offset;
+	int value_size;
+};
+
+struct race_event {
+	unsigned long long time;
+	// value_arg's value, or 0
+	unsigned long long value;
+	unsigned long long pid;
+	// index into race.statuses of the pid this event came from
+	int target;
+	struct race_point *point;
+};
+
+// One of the CPUs we're tracing. With tracer.use_perf, one of the pids
+// instead, and only the events and the counters at the end are used.
+struct trace_cpu {
+	// trace_pipe_raw, or -1
+	int fd;
+	// If the kernel lets us map the ring buffer (6.10 and later),
+	// its meta page and sub-buffers, and we decode the reader
+	// sub-buffer right where it is. Otherwise meta is NULL and each
+	// sub-buffer gets read() into page.
+	struct trace_buffer_meta *meta;
+	char *data;
+	size_t data_len;
+	void *page;
+	struct kbuffer *kbuf;
+	// Events from this CPU that we care about, in the order they
+	// happened, as decoded by decode_cpu(). next is the first one
+	// tracer_collect_stats() hasn't merged in yet. Anything it leaves
+	// for next time gets moved to the front.
+	struct race_event *events;
+	int num_events;
+	int max_events;
+	int next;
+	// With tracer.fast_decode, the sub-buffer decode_subbuf() is on,
+	// how far into its data it got, and the timestamp there. kbuf
+	// isn't used for decoding then.
+	char *subbuf;
+	unsigned int subbuf_off;
+	unsigned long long subbuf_ts;
+	// how many events we went through, matching or not, since the
+	// last tracer_collect_stats()
+	int entries;
+	// set if the kernel dropped events, or we had nowhere to put them
+	int missed;
+	// per_cpu/cpuN/stats, kept open so ftrace_overrun() only has to
+	// pread() it, or -1
+	int stats_fd;
+	// which CPU this is, or with tracer.use_perf, which pid
+	int id;
+	// the overrun count stats_fd showed last time
+	unsigned long long overrun;
+	// how many events the kernel has dropped so far
+	unsigned long long lost;
+	// how far ahead this CPU's clock is, from tracer.cpu_skew
+	long long skew;
+};
+
+struct tracer {
+	struct race_data race;
+	// pid -> index into race.statuses
+	struct pid_table pids;
+	int num_race_points;
+	struct race_point *race_points;
+	// event id -> index into race_points
+	struct id_index race_point_ids;
+	cpu_set_t cpus;
+	int num_cpus;
+	struct trace_cpu *percpu;
+	// how many of those there are: num_cpus, or one per pid with use_perf
+	int num_sources;
+	// Threads that decode CPUs' buffers alongside the one calling
+	// tracer_collect_stats(). Each one takes CPUs starting from
+	// next_cpu until there are none left.
+	int num_decoders;
+	pthread_t *decoders;
+	// how long they spin waiting for the next collect before sleeping
+	int decode_spin;
+	struct sync_word decode_start;
+	struct sync_word decode_done;
+	int decode_stop;
+	int next_cpu;
+	// min-heap of CPUs with events left to merge, by next event time
+	int *heap;
+	// Held while decoding into or merging from the trace_cpus, so the
+	// collector thread (see tracer_start_collector()) stays out of
+	// tracer_collect_stats()'s way.
+	pthread_mutex_t decode_lock;
+	pthread_t collector;
+	int collector_running;
+	int collector_stop;
+	// size of a ring buffer sub-buffer
+	int subbuf_size;
+	// what to set buffer_subbuf_size_kb to, if not 0
+	int subbuf_size_kb;
+	// what it was before, or 0 if we didn't change it
+	int saved_subbuf_size_kb;
+	FILE *tracing_on;
+	// names of the kprobes we've added so far
+	int num_kprobes;
+	char **kprobes;
+	// what trace_clock was before we changed it, or empty if we didn't
+	char saved_trace_clock[32];
+	struct tep_handle *event_parser;
+	struct tep_format_field *common_type;
+	struct tep_format_field *common_pid;
+	// Set if the ring buffer and event layouts are what
+	// decode_subbuf() expects, so we can skip libtraceevent.
+	int fast_decode;
+	// size of the commit field in the sub-buffer header
+	int commit_size;
+	// Our own instances/k_race_<pid>, so we don't step on anybody
+	// else using ftrace. NULL if we couldn't make one, in which case
+	// we use the top level buffer like before.
+	struct tracefs_instance *instance;
+	// the most events any one CPU had in the last tracer_collect_stats()
+	int max_cpu_entries;
+	// what buffer_size_kb is, or 0 if we haven't looked yet
+	int buffer_size_kb;
+	// tracer_calibrate_skew()'s results, indexed by CPU, or NULL if it
+	// hasn't been called
+	long long *cpu_skew;
+	// see tracer_set_event_hook()
+	void (*event_hook)(void *arg, const struct tracer_event *event);
+	void *event_hook_arg;
+	// With tracer_options.bpf, none of the ftrace stuff above is
+	// used once alloc_tracer() is done, and this does the work.
+	int use_bpf;
+	struct trace_bpf *bpf;
+	// Same with tracer_options.perf, except events still get merged
+	// the usual way. percpu[i] holds target i's events.
+	int use_perf;
+	struct trace_perf *perf;
+};
 
 static int read_file(const char *path, char **out) {
 	int n;
@@ -56,53 +245,176 @@ static int read_file(const char *path, char **out) {
 	return pos;
 }
 
-static int set_tracer(const char *tracer) {
-	char *path = tracefs_get_tracing_file("current_tracer");
+// name in our instance. Put with tracefs_put_tracing_file()
+static inline char *tracer_file(struct tracer *tr, const char *name) {
+	return tracefs_instance_get_file(tr->instance, name);
+}
+
+static int write_tracing_file(struct tracer *tr, const char *name, const char *val) {
+	char *path = tracer_file(tr, name);
 	if (!path)
 		return ENOENT; // could also be ENOMEM, but maybe less likely
-	FILE *current_tracer;
+	FILE *file;
 	int err = 0;
-	current_tracer = fopen(path, "w");
-	if (!current_tracer) {
+	file = fopen(path, "w");
+	if (!file) {
 		err = errno;
-		perror("opening current_tracer");
+		fprintf(stderr, "opening %s: %m\n", name);
 		free(path);
 		return err;
 	}
 	free(path);
-	if(fputs(tracer, current_tracer) == EOF)
+	if(fputs(val, file) == EOF)
 		err = errno;
-	if (fclose(current_tracer) == EOF)
+	if (fclose(file) == EOF)
 		err = errno;
 	if (err) {
-		fprintf(stderr, "setting current_tracer to %s: %s\n", tracer, strerror(err));
+		fprintf(stderr, "setting %s to %s: %s\n", name, val, strerror(err));
 	}
 	return err;
 }
 
-#define KPROBE_LENGTH 65
+// Have the kernel drop events from anybody but our targets before they
+// get to the ring buffer. Only done in our own instance, where nobody
+// else's set_event_pid gets clobbered and it goes away with the
+// instance. lookup_pid() still checks every event, so if this doesn't
+// work, everything just gets filtered on our end like before.
+static void set_event_pids(struct tracer *tr) {
+	if (!tr->instance || !tr->race.num_targets)
+		return;
 
-struct race_point {
-	char kprobe_type;
-	char kprobe_name[KPROBE_LENGTH];
-	char kprobe[KPROBE_LENGTH];
-	unsigned long long event_id;
-	int opens;
-	int triggers;
-	int closes;
-};
+	// 20 digits and a space each
+	char *pids = malloc(tr->race.num_targets * 21 + 1);
+	if (!pids) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return;
+	}
+	int n = 0;
+	pids[0] = '\0';
+	for (int i = 0; i < tr->race.num_targets; i++)
+		n += sprintf(pids + n, "%llu ", tr->race.statuses[i].pid);
+	write_tracing_file(tr, "set_event_pid", pids);
+	free(pids);
+}
 
-struct race_event {
-	unsigned long long time;
-	unsigned long long pid;
-	struct race_point *point;
-};
+static int set_tracer(struct tracer *tr, const char *tracer) {
+	return write_tracing_file(tr, "current_tracer", tracer);
+}
+
+// Same clock as DELAY_CLOCK, so that event timestamps can be compared
+// with the start times the workers record.
+#define TRACE_CLOCK "mono_raw"
+
+// trace_clock reads like "[local] global counter uptime ..."
+static int save_trace_clock(struct tracer *tr) {
+	char *buf;
+	char *path = tracer_file(tr, "trace_clock");
+	if (!path)
+		return ENOENT;
+	int size = read_file(path, &buf);
+	tracefs_put_tracing_file(path);
+	if (size < 0)
+		return -size;
+	buf[size] = '\0';
+
+	char *start = strchr(buf, '[');
+	char *end = start ? strchr(start, ']') : NULL;
+	if (!end || end - start - 1 >= sizeof(tr->saved_trace_clock)) {
+		fprintf(stderr, "can't parse trace_clock: %s\n", buf);
+		free(buf);
+		return EINVAL;
+	}
+	memcpy(tr->saved_trace_clock, start + 1, end - start - 1);
+	tr->saved_trace_clock[end - start - 1] = '\0';
+	free(buf);
+	return 0;
+}
+
+static int set_trace_clock(struct tracer *tr) {
+	int err = save_trace_clock(tr);
+	if (err)
+		return err;
+	err = write_tracing_file(tr, "trace_clock", TRACE_CLOCK);
+	if (err) {
+		fprintf(stderr, "can't use the %s trace clock, so results can only be "
+			"credited to requested offsets\n", TRACE_CLOCK);
+		tr->saved_trace_clock[0] = '\0';
+	}
+	return 0;
+}
+
+static void restore_trace_clock(struct tracer *tr) {
+	if (tr->saved_trace_clock[0])
+		write_tracing_file(tr, "trace_clock", tr->saved_trace_clock);
+	tr->saved_trace_clock[0] = '\0';
+}
+
+int tracer_same_clock(struct tracer *tr) {
+	// perf events are opened with clockid = DELAY_CLOCK
+	if (tr->use_perf)
+		return 1;
+	// never set with BPF, where there are no timestamps to compare
+	return tr->saved_trace_clock[0] != '\0';
+}
+
+// for buffer_size_kb and buffer_subbuf_size_kb
+static int read_size_kb(struct tracer *tr, const char *name) {
+	char *buf;
+	char *path = tracer_file(tr, name);
+	if (!path)
+		return -ENOENT;
+	int size = read_file(path, &buf);
+	tracefs_put_tracing_file(path);
+	if (size < 0)
+		return size;
+	buf[size] = '\0';
+	int kb = atoi(buf);
+	free(buf);
+	return kb > 0 ? kb : -EINVAL;
+}
+
+// Bigger sub-buffers mean fewer of them to go through per batch. Kernels
+// before 6.7 only have page sized ones.
+static int set_subbuf_size(struct tracer *tr) {
+	int kb = read_size_kb(tr, "buffer_subbuf_size_kb");
+
+	tr->subbuf_size = kb > 0 ? kb * 1024 : getpagesize();
+	if (!tr->subbuf_size_kb || kb == tr->subbuf_size_kb)
+		return 0;
+	if (kb < 0) {
+		fprintf(stderr, "this kernel doesn't support changing the ring buffer "
+			"sub-buffer size, using %d bytes\n", tr->subbuf_size);
+		return 0;
+	}
 
-static void clear_kprobe(FILE *events, const char *name) {
+	char val[16];
+	snprintf(val, sizeof(val), "%d", tr->subbuf_size_kb);
+	int err = write_tracing_file(tr, "buffer_subbuf_size_kb", val);
+	if (err)
+		return err;
+	tr->saved_subbuf_size_kb = kb;
+	// the kernel rounds it up to a power of two number of pages
+	kb = read_size_kb(tr, "buffer_subbuf_size_kb");
+	if (kb > 0)
+		tr->subbuf_size = kb * 1024;
+	return 0;
+}
+
+static void restore_subbuf_size(struct tracer *tr) {
+	char val[16];
+
+	if (!tr->saved_subbuf_size_kb)
+		return;
+	snprintf(val, sizeof(val), "%d", tr->saved_subbuf_size_kb);
+	write_tracing_file(tr, "buffer_subbuf_size_kb", val);
+	tr->saved_subbuf_size_kb = 0;
+}
+
+static void clear_kprobe(struct tracer *tr, FILE *events, const char *name) {
 	char *filename;
 	if (asprintf(&filename, "events/kprobes/%s/enable", name) == -1)
 		return;
-	char *path = tracefs_get_tracing_file(filename);
+	char *path = tracer_file(tr, filename);
 	if (!path) {
 		free(filename);
 		return;
@@ -135,26 +447,54 @@ static void clear_kprobe(FILE *events, const char *name) {
 		fclose(events);
 }
 
-static int num_kprobes;
-static char **kprobes;
+// Only in our instance, like enabling it, so the kernel drops
+// everything the filter doesn't match before it gets to the buffer.
+static int set_filter(struct tracer *tr, struct race_point *p) {
+	char *filename;
+	int err = 0;
+
+	if (asprintf(&filename, "events/kprobes/%s/filter", p->kprobe_name) == -1)
+		return ENOMEM;
+	char *path = tracer_file(tr, filename);
+	free(filename);
+	if (!path)
+		return ENOMEM;
+	FILE *f = fopen(path, "w");
+	tracefs_put_tracing_file(path);
+	if (!f)
+		return errno;
+	if (fputs(p->filter, f) == EOF)
+		err = errno;
+	// the kernel only checks it when it's flushed
+	if (fclose(f) == EOF && !err)
+		err = errno;
+	if (err)
+		fprintf(stderr, "bad filter \"%s\" for %s: %s\n", p->filter,
+			p->kprobe, strerror(err));
+	return err;
+}
 
-static int add_kprobe(FILE *kprobe_events, struct race_point *p,
-		      struct tep_handle *tep, int idx) {
+static int add_kprobe(struct tracer *tr, FILE *kprobe_events,
+		      struct race_point *p) {
+	struct tep_handle *tep = tr->event_parser;
 	int err;
 
-	if (!(fprintf(kprobe_events, "%c:%s %s\n",
-		      p->kprobe_type, p->kprobe_name, p->kprobe) > 0 &&
+	const char *args = p->fetch_args ? p->fetch_args : "";
+	const char *sep = p->fetch_args ? " " : "";
+
+	if (!(fprintf(kprobe_events, "%c:%s %s%s%s\n",
+		      p->kprobe_type, p->kprobe_name, p->kprobe, sep, args) > 0 &&
 	      fflush(kprobe_events) != EOF)) {
-		fprintf(stderr, "adding kprobe \"%c:%s %s\": %m\n",
-			p->kprobe_type, p->kprobe_name, p->kprobe);
+		fprintf(stderr, "adding kprobe \"%c:%s %s%s%s\": %m\n",
+			p->kprobe_type, p->kprobe_name, p->kprobe, sep, args);
 		return errno;
 	}
 
-	char **k = realloc(kprobes, (num_kprobes + 1) * sizeof(char *));
+	char **k = realloc(tr->kprobes, (tr->num_kprobes + 1) * sizeof(char *));
 	if (!k)
 		return ENOMEM;
-	kprobes = k;
-	kprobes[num_kprobes++] = p->kprobe_name;
+	tr->kprobes = k;
+	tr->kprobes[tr->num_kprobes++] = p->kprobe_name;
 
 	char *filename;
 	if (asprintf(&filename, "events/kprobes/%s/format", p->kprobe_name) == -1) {
@@ -183,9 +523,27 @@ static int add_kprobe(FILE *kprobe_events, struct race_point *p,
 
 	struct tep_event *ev = tep_find_event_by_name(tep, "kprobes", p->kprobe_name);
 	p->event_id = ev->id;
+	if (p->value_arg) {
+		struct tep_format_field *field = tep_find_field(ev, p->value_arg);
+
+		if (!field || field->size > sizeof(unsigned long long)) {
+			fprintf(stderr, "kprobe %s has no arg %s that fits in 64 bits\n",
+				p->kprobe_name, p->value_arg);
+			err = EINVAL;
+			goto out_err;
+		}
+		p->value_offset = field->offset;
+		p->value_size = field->size;
+	}
+	if (p->filter) {
+		err = set_filter(tr, p);
+		if (err)
+			goto out_err;
+	}
+	// only enabled in our instance, the kprobe itself is global
 	if (asprintf(&filename, "events/kprobes/%s/enable", p->kprobe_name) == -1)
 		return ENOMEM;
-	path = tracefs_get_tracing_file(filename);
+	path = tracer_file(tr, filename);
 	free(filename);
 	if (!path) {
 		err = ENOMEM;
@@ -210,11 +568,11 @@ static int add_kprobe(FILE *kprobe_events, struct race_point *p,
 
 out_err:
 	fprintf(stderr, "error adding kprobe %s: %s\n", p->kprobe_name, strerror(err));
-	clear_kprobe(NULL, p->kprobe_name);
+	clear_kprobe(tr, NULL, p->kprobe_name);
 	return err;
 }
 
-static void clear_kprobes(void) {
+static void clear_kprobes(struct tracer *tr) {
 	char *path = tracefs_get_tracing_file("kprobe_events");
 	if (!path)
 		return;
@@ -223,41 +581,33 @@ static void clear_kprobes(void) {
 	if (!events) {
 		return;
 	}
-	for (int i = 0; i < num_kprobes; i++) {
-		clear_kprobe(events, kprobes[i]);
+	for (int i = 0; i < tr->num_kprobes; i++) {
+		clear_kprobe(tr, events, tr->kprobes[i]);
 	}
 	fclose(events);
-	free(kprobes);
-	num_kprobes = 0;
-	kprobes = NULL;
+	free(tr->kprobes);
+	tr->num_kprobes = 0;
+	tr->kprobes = NULL;
 }
 
-struct race_data {
-	struct race_status {
-		int open;
-		unsigned long long pid;
-	} *statuses;
-	int count;
-	int triggers;
-};
+static int index_race_points(struct tracer *tr) {
+	if (!tr->num_race_points) {
+		id_index_free(&tr->race_point_ids);
+		return 0;
+	}
 
-struct tracer {
-	int num_targets;
-	struct race_data race;
-	struct race_event *current_events;
-	int num_race_points;
-	struct race_point *race_points;
-	cpu_set_t cpus;
-	void *pages;
-	int *finished;
-	struct kbuffer **kbufs;
-	struct tep_handle *event_parser;
-	struct tep_format_field *common_type;
-	struct tep_format_field *common_pid;
-};
+	unsigned long long ids[tr->num_race_points];
+	for (int i = 0; i < tr->num_race_points; i++)
+		ids[i] = tr->race_points[i].event_id;
+	if (id_index_build(&tr->race_point_ids, tr->num_race_points, ids)) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return ENOMEM;
+	}
+	return 0;
+}
 
 static int register_kprobes(struct tracer *tr) {
-	int err = set_tracer("nop");
+	int err = set_tracer(tr, "nop");
 	if (err)
 		return err;
 	char *path = tracefs_get_tracing_file("kprobe_events");
@@ -265,7 +615,7 @@ static int register_kprobes(struct tracer *tr) {
 		fprintf(stderr, "can't get \"kprobe_events\" ftrace file\n");
 		return -1;
 	}
-	FILE *events = fopen(path, "w");
+	FILE *events = fopen(path, "a");
 	if (!events) {
 		err = errno;
 		fprintf(stderr, "opening %s: %m\n", path);
@@ -276,15 +626,18 @@ static int register_kprobes(struct tracer *tr) {
 
 	for (int i = 0; i < tr->num_race_points; i++) {
 		struct race_point *p = &tr->race_points[i];
-		err = add_kprobe(events, p, tr->event_parser, i);
+		err = add_kprobe(tr, events, p);
 		if (err)
 			goto out_err;
 	}
+	err = index_race_points(tr);
+	if (err)
+		goto out_err;
 
 	fclose(events);
 	return 0;
 out_err:
-	clear_kprobes();
+	clear_kprobes(tr);
 	fclose(events);
 	return err;
 }
@@ -311,16 +664,56 @@ static int initialize_parser(struct tracer *tr) {
 	return err;
 }
 
-int tracer_add_pid(struct tracer *tr, pid_t pid) {
-	tr->num_targets++;
-	struct race_status *s = realloc(tr->race.statuses,
-					sizeof(struct race_status) * tr->num_targets);
-	if (!s)
-		return ENOMEM;
-	memset(s+tr->num_targets-1, 0, sizeof(*s));
+// With use_perf, a trace_cpu for the next target, which is also the
+// ring trace_perf_add_pid() opens next.
+static int add_perf_source(struct tracer *tr) {
+	int n = tr->num_sources + 1;
+	struct trace_cpu *percpu = realloc(tr->percpu, sizeof(*percpu) * n);
+	if (!percpu)
+		goto oom;
+	tr->percpu = percpu;
+	memset(&percpu[n - 1], 0, sizeof(*percpu));
+	percpu[n - 1].fd = -1;
+	percpu[n - 1].stats_fd = -1;
+
+	int *heap = realloc(tr->heap, sizeof(*heap) * n);
+	if (!heap)
+		goto oom;
+	tr->heap = heap;
+	tr->num_sources = n;
+	return 0;
+
+oom:
+	fprintf(stderr, "%s: OOM\n", __func__);
+	return ENOMEM;
+}
 
-	s[tr->num_targets-1].pid = pid;
-	tr->race.statuses = s;
+static int perf_add_pid(struct tracer *tr, pid_t pid) {
+	// the collector might be going through percpu
+	pthread_mutex_lock(&tr->decode_lock);
+	int err = add_perf_source(tr);
+	if (!err) {
+		tr->percpu[tr->num_sources - 1].id = pid;
+		err = trace_perf_add_pid(tr->perf, pid);
+		if (err)
+			tr->num_sources--;
+	}
+	pthread_mutex_unlock(&tr->decode_lock);
+	return err;
+}
+
+int tracer_add_pid(struct tracer *tr, pid_t pid, int group) {
+	if (pid_table_reserve(&tr->pids, tr->race.num_targets + 1))
+		return ENOMEM;
+	if (race_add_target(&tr->race, pid, group))
+		return ENOMEM;
+	pid_table_insert(&tr->pids, pid, tr->race.num_targets - 1);
+	if (tr->tracing_on)
+		set_event_pids(tr);
+	if (tr->bpf)
+		return trace_bpf_add_pid(tr->bpf, pid, tr->race.num_targets - 1, group);
+	if (tr->perf)
+		return perf_add_pid(tr, pid);
 	return 0;
 }
 
@@ -373,7 +766,7 @@ static int add_comms(struct tracer *tr, int num_comms, const char **comms) {
 				break;
 
 			comm_found[i] = 1;
-			tracer_add_pid(tr, pid);
+			tracer_add_pid(tr, pid, TRACER_ALL_GROUPS);
 			needed--;
 			break;
 		}
@@ -399,80 +792,153 @@ static int add_comms(struct tracer *tr, int num_comms, const char **comms) {
 	return 0;
 }
 
-static int *trace_fds;
-static int num_cpus;
+static void close_trace_fds(struct tracer *tr) {
+	for (int i = 0; i < tr->num_sources; i++) {
+		struct trace_cpu *c = &tr->percpu[i];
 
-static void clear_buffers(void) {
-	char *buf = malloc(getpagesize());
-	if (!buf) {
-		fprintf(stderr, "%s: OOM\n", __func__);
-		return;
-	}
-	for (int i = 0; i < num_cpus; i++) {
-		int n;
-		do {
-			n = read(trace_fds[i], buf, getpagesize());
-		} while (n > 0);
+		if (c->meta) {
+			munmap(c->data, c->data_len);
+			munmap(c->meta, c->meta->meta_page_size);
+			c->meta = NULL;
+		}
+		free(c->page);
+		c->page = NULL;
+		if (c->fd >= 0)
+			close(c->fd);
+		c->fd = -1;
+		if (c->stats_fd >= 0)
+			close(c->stats_fd);
+		c->stats_fd = -1;
 	}
-	free(buf);
 }
 
-static struct sigaction sigint_old;
+static void create_instance(struct tracer *tr) {
+	char name[32];
+
+	snprintf(name, sizeof(name), "k_race_%d", getpid());
+	tr->instance = tracefs_instance_create(name);
+	if (!tr->instance)
+		fprintf(stderr, "can't create ftrace instance %s, using the top "
+			"level buffer: %m\n", name);
+}
+
+// Everything in it has to be closed first.
+static void destroy_instance(struct tracer *tr) {
+	if (!tr->instance)
+		return;
+	if (tracefs_instance_destroy(tr->instance))
+		fprintf(stderr, "removing ftrace instance %s: %m\n",
+			tracefs_instance_get_name(tr->instance));
+	tracefs_instance_free(tr->instance);
+	tr->instance = NULL;
+}
 
+// Signal handlers are per process, so only one tracer at a time gets
+// cleaned up on SIGINT: the last one passed to ftrace_init().
+static struct sigaction sigint_old;
+static struct tracer *sigint_tracer;
+static volatile sig_atomic_t sigint_received;
+
+// The collector and decoder threads might be in the middle of reading
+// the buffers, so all we do here is tell the main thread, which stops
+// them and cleans up (see tracer_interrupted()). If it's stuck and
+// doesn't get to it, a second SIGINT does whatever it would have
+// without us, so there's still a way out.
 static void sigint_handler(int sig) {
-	// TODO: this handler can race in a bunch of places, should fix
-	disable_tracing();
-	clear_kprobes();
-
-	if (trace_fds) {
-		clear_buffers();
-		for (int i = 0; i < num_cpus; i++)
-			if (trace_fds[i] > 0)
-				close(trace_fds[i]);
-	}
-	enable_tracing();
-	if (sigint_old.sa_handler)
-		sigint_old.sa_handler(sig);
-	else
-		exit(0);
+	if (!sigint_received) {
+		sigint_received = 1;
+		return;
+	}
+	sigaction(SIGINT, &sigint_old, NULL);
+	raise(sig);
+}
+
+int tracer_interrupted(struct tracer *tr) {
+	return tr == sigint_tracer && sigint_received;
 }
 
 void free_percpu(struct tracer *tr) {
-	for (int i = 0; i < num_cpus; i++) {
-		kbuffer_free(tr->kbufs[i]);
+	for (int i = 0; i < tr->num_sources; i++) {
+		if (tr->percpu[i].kbuf)
+			kbuffer_free(tr->percpu[i].kbuf);
+		free(tr->percpu[i].events);
 	}
-	free(tr->kbufs);
-	free(tr->pages);
-	free(tr->finished);
+	free(tr->percpu);
+	free(tr->heap);
 }
 
-int ftrace_exit(void) {
-	if (trace_fds) {
-		for (int i = 0; i < num_cpus; i++)
-			if (trace_fds[i] > 0)
-				close(trace_fds[i]);
+static void stop_decoders(struct tracer *tr);
+static void stop_collector(struct tracer *tr);
+
+
+int ftrace_exit(struct tracer *tr) {
+	if (tr->use_bpf) {
+		trace_bpf_close(tr->bpf);
+		tr->bpf = NULL;
+		return 0;
+	}
+	if (tr->use_perf) {
+		stop_collector(tr);
+		stop_decoders(tr);
+		trace_perf_close(tr->perf);
+		tr->perf = NULL;
+		return 0;
 	}
-	int *tmp = trace_fds;
-	trace_fds = NULL; // try not to race with signal handler
-	free(tmp);
-	int err = set_tracer("nop");
+	stop_collector(tr);
+	stop_decoders(tr);
+	close_trace_fds(tr);
+	int err = set_tracer(tr, "nop");
 	if (err)
 		return err;
-	clear_kprobes();
-	enable_tracing();
-	if (fclose(tracing_on) == EOF) {
+	clear_kprobes(tr);
+	restore_trace_clock(tr);
+	restore_subbuf_size(tr);
+	enable_tracing(tr);
+	if (fclose(tr->tracing_on) == EOF) {
 		err = errno;
 		fprintf(stderr, "writing to tracing_on: %m\n");
 	}
+	destroy_instance(tr);
 	sigaction(SIGINT, &sigint_old, NULL);
+	sigint_tracer = NULL;
 	return err;
 }
 
-static int open_trace_fds(cpu_set_t *cpus) {
+// Returns 0 if the ring buffer behind c->fd is now mapped, or if it
+// just can't be, in which case we'll read() it instead.
+static int map_cpu(struct tracer *tr, struct trace_cpu *c) {
+	struct trace_buffer_meta *meta = mmap(NULL, getpagesize(), PROT_READ,
+					      MAP_SHARED, c->fd, 0);
+	if (meta == MAP_FAILED)
+		goto read_instead;
+	if (meta->meta_page_size != getpagesize()) {
+		munmap(meta, getpagesize());
+		goto read_instead;
+	}
+	c->data_len = (size_t)meta->subbuf_size * meta->nr_subbufs;
+	c->data = mmap(NULL, c->data_len, PROT_READ, MAP_SHARED, c->fd,
+		       meta->meta_page_size);
+	if (c->data == MAP_FAILED) {
+		munmap(meta, meta->meta_page_size);
+		goto read_instead;
+	}
+	c->meta = meta;
+	return 0;
+
+read_instead:
+	c->page = malloc(tr->subbuf_size);
+	if (!c->page) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static int open_trace_fds(struct tracer *tr) {
 	int err = 0;
 	DIR *dir;
 	struct dirent *d;
-	char *path = tracefs_get_tracing_file("per_cpu");
+	char *path = tracer_file(tr, "per_cpu");
 	if (!path) {
 		fprintf(stderr, "%s: can't get per_cpu ftrace file\n", __func__);
 		return -1;
@@ -508,11 +974,24 @@ static int open_trace_fds(cpu_set_t *cpus) {
                  * online cpus you get from the cpu_set_t returned by pthread_getaffinity_np
                  * are the same as the values in the kernel internal struct cpuset. need
                  * to verify that */
-		if (CPU_ISSET(cpu, cpus)) {
-			trace_fds[i++] = fd;
-		} else {
+		if (!CPU_ISSET(cpu, &tr->cpus) || i >= tr->num_cpus) {
 			close(fd);
+			continue;
+		}
+		tr->percpu[i].fd = fd;
+		tr->percpu[i].id = cpu;
+		if (asprintf(&filename, "%s/%s/stats", path, d->d_name) == -1) {
+			err = ENOMEM;
+			break;
 		}
+		// ftrace_overrun() just does without it
+		tr->percpu[i].stats_fd = open(filename, O_RDONLY);
+		if (tr->percpu[i].stats_fd < 0)
+			fprintf(stderr, "error opening %s: %m\n", filename);
+		free(filename);
+		err = map_cpu(tr, &tr->percpu[i++]);
+		if (err)
+			break;
 	}
 
 	closedir(dir);
@@ -520,53 +999,55 @@ static int open_trace_fds(cpu_set_t *cpus) {
 	return err;
 }
 
-static int alloc_percpu(struct tracer *tr) {
-	int err = 0;
+static struct kbuffer *alloc_kbuf(struct tracer *tr) {
+	enum kbuffer_endian end = tep_is_local_bigendian(tr->event_parser) ?
+		KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE;
+	enum kbuffer_long_size sz = sizeof(long) == 8 ?
+		KBUFFER_LSIZE_8 : KBUFFER_LSIZE_4;
+
+	return kbuffer_alloc(sz, end);
+}
 
-	tr->pages = malloc(getpagesize() * num_cpus);
-	if (!tr->pages) {
+static int alloc_percpu(struct tracer *tr) {
+	tr->percpu = calloc(tr->num_cpus, sizeof(*tr->percpu));
+	if (!tr->percpu) {
 		fprintf(stderr, "%s: OOM\n", __func__);
 		return ENOMEM;
 	}
-	tr->finished = malloc(sizeof(int) * num_cpus);
-	if (!tr->finished) {
-		fprintf(stderr, "%s: OOM\n", __func__);
-		err = ENOMEM;
-		goto free_pages;
-	}
-	tr->kbufs = malloc(sizeof(*tr->kbufs) * num_cpus);
-	if (!tr->kbufs) {
+
+	tr->heap = malloc(sizeof(*tr->heap) * tr->num_cpus);
+	if (!tr->heap) {
 		fprintf(stderr, "%s: OOM\n", __func__);
-		err = ENOMEM;
-		goto free_finished;
+		free_percpu(tr);
+		return ENOMEM;
 	}
-	memset(tr->finished, 0, sizeof(int) * num_cpus);
-	memset(tr->pages, 0, getpagesize() * num_cpus);
-	memset(tr->kbufs, 0, sizeof(*tr->kbufs) * num_cpus);
-
-	enum kbuffer_endian end = tep_is_local_bigendian(tr->event_parser) ?
-		KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE;
-	enum kbuffer_long_size sz = sizeof(long) == 8 ?
-		KBUFFER_LSIZE_8 : KBUFFER_LSIZE_4;
-	for (int i = 0; i < num_cpus; i++) {
-		tr->kbufs[i] = kbuffer_alloc(sz, end);
-		if (!tr->kbufs[i]) {
-			err = ENOMEM;
-			goto free_kbufs;
+	tr->num_sources = tr->num_cpus;
+	for (int i = 0; i < tr->num_cpus; i++) {
+		tr->percpu[i].fd = -1;
+		tr->percpu[i].stats_fd = -1;
+		tr->percpu[i].kbuf = alloc_kbuf(tr);
+		if (!tr->percpu[i].kbuf) {
+			free_percpu(tr);
+			return ENOMEM;
 		}
 	}
 	return 0;
+}
 
-free_kbufs:
-	for (int i = 0; i < num_cpus; i++)
-		if (tr->kbufs[i])
-			free(tr->kbufs[i]);
-	free(tr->kbufs);
-free_finished:
-	free(tr->finished);
-free_pages:
-	free(tr->pages);
-	return err;
+// Forget where we were in each CPU's buffer, for when they've been
+// closed and are about to be opened again. Decoded events are kept.
+static int reset_percpu(struct tracer *tr) {
+	for (int i = 0; i < tr->num_sources; i++) {
+		struct trace_cpu *c = &tr->percpu[i];
+		struct kbuffer *kbuf = alloc_kbuf(tr);
+
+		if (!kbuf)
+			return ENOMEM;
+		kbuffer_free(c->kbuf);
+		c->kbuf = kbuf;
+		c->subbuf = NULL;
+	}
+	return 0;
 }
 
 static int copy_race_points(struct tracer *tr,
@@ -586,8 +1067,12 @@ static int copy_race_points(struct tracer *tr,
 		p->opens = kp->opens;
 		p->triggers = kp->triggers;
 		p->closes = kp->closes;
+		p->fetch_args = kp->fetch_args;
+		p->filter = kp->filter;
+		p->value_arg = kp->value_arg;
 
-		sprintf(p->kprobe_name, "k_race_%d", i);
+		// kprobes are global, so keep out of other k-race processes' way
+		sprintf(p->kprobe_name, "k_race_%d_%d", getpid(), i);
 
 		int len = strlen(kp->description);
 		if (len > KPROBE_LENGTH - 15) {
@@ -608,13 +1093,19 @@ static int copy_race_points(struct tracer *tr,
 	return 0;
 }
 
-struct tracer *alloc_tracer(struct k_race_config *config) {
+struct tracer *alloc_tracer(struct k_race_config *config,
+			    const struct tracer_options *opts) {
 	struct tracer *ret = malloc(sizeof(*ret));
 	if (!ret) {
 		fprintf(stderr, "%s: OOM\n", __func__);
 		return NULL;
 	}
 	memset(ret, 0, sizeof(*ret));
+	pthread_mutex_init(&ret->decode_lock, NULL);
+	ret->race.num_groups = opts->num_groups;
+	ret->subbuf_size_kb = opts->subbuf_size_kb;
+	ret->use_bpf = opts->bpf;
+	ret->use_perf = opts->perf;
 
 	ret->event_parser = tep_alloc();
 	if (!ret->event_parser)
@@ -634,35 +1125,35 @@ struct tracer *alloc_tracer(struct k_race_config *config) {
 			}
 		}
 	}
-	num_cpus = CPU_COUNT(&ret->cpus);
+	ret->num_cpus = CPU_COUNT(&ret->cpus);
 
-	err = alloc_percpu(ret);
-	if (err)
-		goto free_tep;
-
-	ret->current_events = malloc(sizeof(struct race_event) * num_cpus);
-	if (!ret->current_events) {
-		fprintf(stderr, "%s: OOM\n", __func__);
-		goto free_pcpu;
+	// with perf, they come one at a time from tracer_add_pid()
+	if (!ret->use_perf) {
+		err = alloc_percpu(ret);
+		if (err)
+			goto free_tep;
 	}
-	memset(ret->current_events, 0, sizeof(struct race_event) * num_cpus);
 
 	err = copy_race_points(ret, config);
 	if (err)
-		goto free_events;
+		goto free_pcpu;
+	err = race_compile(&ret->race, config, NULL, config->num_race_points);
+	if (err) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		goto free_points;
+	}
 
 	err = add_comms(ret, config->num_comms, config->comms);
 	if (err)
-		goto free_statuses;
+		goto free_race;
 
 	return ret;
 
-free_statuses:
-	if (ret->race.statuses)
-		free(ret->race.statuses);
+free_race:
+	race_free(&ret->race);
+	pid_table_free(&ret->pids);
+free_points:
 	free(ret->race_points);
-free_events:
-	free(ret->current_events);
 free_pcpu:
 	free_percpu(ret);
 free_tep:
@@ -675,93 +1166,274 @@ free_tr:
 
 void free_tracer(struct tracer *tr) {
 	tep_free(tr->event_parser);
+	free(tr->cpu_skew);
 	free_percpu(tr);
-	free(tr->race.statuses);
+	race_free(&tr->race);
+	pid_table_free(&tr->pids);
 	free(tr->race_points);
-	free(tr->current_events);
+	id_index_free(&tr->race_point_ids);
 	free(tr);
 }
 
+// The fixed layout decode_subbuf() reads our events with: the common
+// fields every event starts with.
+struct common_fields {
+	unsigned short type;
+	unsigned char flags;
+	unsigned char preempt_count;
+	int pid;
+};
+
+// decode_subbuf() only works if the kernel uses the layouts above, we
+// run with the same endianness and word size, and the header page
+// matches what initialize_parser() found.
+static void check_fast_decode(struct tracer *tr) {
+	struct tep_handle *tep = tr->event_parser;
+
+	tr->fast_decode = 0;
+	if (tep_is_local_bigendian(tep) || tep_is_file_bigendian(tep))
+		return;
+	if (tep_get_header_timestamp_size(tep) != 8)
+		return;
+	tr->commit_size = tep_get_header_page_size(tep);
+	if (tr->commit_size != 4 && tr->commit_size != 8)
+		return;
+	if (!tr->common_type || !tr->common_pid ||
+	    tr->common_type->offset != offsetof(struct common_fields, type) ||
+	    tr->common_type->size != sizeof(unsigned short) ||
+	    tr->common_pid->offset != offsetof(struct common_fields, pid) ||
+	    tr->common_pid->size != sizeof(int))
+		return;
+	tr->fast_decode = 1;
+}
+
+int parse_kprobe(const char *kprobe, char *func, size_t len,
+		 unsigned long *offset) {
+	const char *plus = strchr(kprobe, '+');
+	size_t n = plus ? plus - kprobe : strlen(kprobe);
+	char *end;
+
+	*offset = 0;
+	if (n >= len)
+		return ENAMETOOLONG;
+	memcpy(func, kprobe, n);
+	func[n] = '\0';
+	if (!plus)
+		return 0;
+	*offset = strtoul(plus + 1, &end, 0);
+	return *end ? EINVAL : 0;
+}
+
+// perf and BPF attach the kprobes themselves, without any of ftrace's
+// fetch args or filters
+static int plain_kprobes(struct tracer *tr, const char *opt) {
+	for (int i = 0; i < tr->num_race_points; i++) {
+		struct race_point *p = &tr->race_points[i];
+
+		if (p->fetch_args || p->filter) {
+			fprintf(stderr, "%s can't fetch kprobe args or filter on them, "
+				"as %s wants\n", opt, p->kprobe);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int bpf_init(struct tracer *tr) {
+	struct trace_bpf_point points[tr->num_race_points];
+
+	if (plain_kprobes(tr, "--bpf"))
+		return EINVAL;
+	if (!race_single_points(&tr->race)) {
+		fprintf(stderr, "--bpf only counts single race points triggered "
+			"by other threads, not \"all_of\", \"sequence\" or \"thread\"\n");
+		return EINVAL;
+	}
+	for (int i = 0; i < tr->num_race_points; i++) {
+		struct race_point *p = &tr->race_points[i];
+
+		points[i].type = p->kprobe_type;
+		points[i].kprobe = p->kprobe;
+		points[i].opens = p->opens;
+		points[i].triggers = p->triggers;
+		points[i].closes = p->closes;
+	}
+	tr->bpf = trace_bpf_open(tr->num_race_points, points, tr->race.num_groups);
+	if (!tr->bpf)
+		return -1;
+	// anything added by alloc_tracer()
+	for (int i = 0; i < tr->race.num_targets; i++) {
+		struct race_status *s = &tr->race.statuses[i];
+		int err = trace_bpf_add_pid(tr->bpf, s->pid, i, s->group);
+		if (err) {
+			trace_bpf_close(tr->bpf);
+			tr->bpf = NULL;
+			return err;
+		}
+	}
+	return 0;
+}
+
+static int perf_init(struct tracer *tr) {
+	struct trace_perf_point points[tr->num_race_points];
+
+	if (plain_kprobes(tr, "--perf"))
+		return EINVAL;
+
+	for (int i = 0; i < tr->num_race_points; i++) {
+		points[i].type = tr->race_points[i].kprobe_type;
+		points[i].kprobe = tr->race_points[i].kprobe;
+	}
+	tr->perf = trace_perf_open(tr->num_race_points, points);
+	if (!tr->perf)
+		return -1;
+	// anything added by alloc_tracer()
+	for (int i = 0; i < tr->race.num_targets; i++) {
+		int err = perf_add_pid(tr, tr->race.statuses[i].pid);
+		if (err) {
+			trace_perf_close(tr->perf);
+			tr->perf = NULL;
+			return err;
+		}
+	}
+	return 0;
+}
+
 int ftrace_init(struct tracer *tr) {
 	int err;
-	char *path = tracefs_get_tracing_file("tracing_on");
-	if (!path)
-		return ENOMEM;
-	tracing_on = fopen(path, "w");
-	if (!tracing_on) {
+
+	if (tr->use_bpf)
+		return bpf_init(tr);
+	if (tr->use_perf)
+		return perf_init(tr);
+	create_instance(tr);
+	char *path = tracer_file(tr, "tracing_on");
+	if (!path) {
+		err = ENOMEM;
+		goto destroy_instance;
+	}
+	tr->tracing_on = fopen(path, "w");
+	if (!tr->tracing_on) {
 		err = errno;
 		fprintf(stderr, "error opening %s: m\n", path);
 		tracefs_put_tracing_file(path);
-		return err;
+		goto destroy_instance;
 	}
 	tracefs_put_tracing_file(path);
-	disable_tracing();
+	disable_tracing(tr);
 
+	sigint_tracer = tr;
+	sigint_received = 0;
 	if (sigaction(SIGINT, NULL, &sigint_old) == -1) {
 		err = errno;
 		perror("sigaction");
 		goto close_tracing_on;
 	}
-	struct sigaction sa = { .sa_handler = sigint_handler };
+	struct sigaction sa = {
+		.sa_handler = sigint_handler,
+		// it only sets a flag, so no need to interrupt syscalls for it
+		.sa_flags = SA_RESTART,
+	};
 	if (sigaction(SIGINT, &sa, NULL) == -1) {
 		err = errno;
 		perror("sigaction");
 		goto close_tracing_on;
 	}
 
-	err = register_kprobes(tr);
+	err = set_trace_clock(tr);
 	if (err)
 		goto restore_sighand;
 
+	// before opening anything, since it resets the ring buffers
+	err = set_subbuf_size(tr);
+	if (err)
+		goto restore_clock;
+
+	err = register_kprobes(tr);
+	if (err)
+		goto restore_subbuf;
+	// anything added by alloc_tracer()
+	set_event_pids(tr);
+
 	struct tep_event *ev = tep_get_first_event(tr->event_parser);
 	tr->common_type = tep_find_common_field(ev, "common_type");
 	tr->common_pid = tep_find_common_field(ev, "common_pid");
+	check_fast_decode(tr);
 
-	trace_fds = malloc(sizeof(int) * num_cpus);
-	if (!trace_fds) {
-		err = ENOMEM;
-		fprintf(stderr, "%s: OOM\n", __func__);
-		goto reset_ftrace;
-	}
-	err = open_trace_fds(&tr->cpus);
+	err = open_trace_fds(tr);
 	if (err)
 		goto close_fds;
 	return 0;
 
 close_fds:
-	for (int i = 0; i < num_cpus; i++)
-		if (trace_fds[i] > 0)
-			close(trace_fds[i]);
-	free(trace_fds);
-reset_ftrace:
-	clear_kprobes();
+	close_trace_fds(tr);
+	clear_kprobes(tr);
+restore_subbuf:
+	restore_subbuf_size(tr);
+restore_clock:
+	restore_trace_clock(tr);
 restore_sighand:
 	sigaction(SIGINT, &sigint_old, NULL);
 close_tracing_on:
-	fclose(tracing_on);
+	sigint_tracer = NULL;
+	fclose(tr->tracing_on);
+destroy_instance:
+	destroy_instance(tr);
 	return err;
 }
 
-int enable_tracing(void) {
-	if (fputc('1', tracing_on) == EOF ||
-	    fflush(tracing_on) == EOF) {
+int enable_tracing(struct tracer *tr) {
+	if (tr->use_bpf) {
+		trace_bpf_enable(tr->bpf, 1);
+		return 0;
+	}
+	if (tr->use_perf)
+		return trace_perf_enable(tr->perf, 1);
+	if (fputc('1', tr->tracing_on) == EOF ||
+	    fflush(tr->tracing_on) == EOF) {
 		fprintf(stderr, "%s: write to tracing_on %m\n", __func__);
 		return -1;
 	}
 	return 0;
 }
 
-int disable_tracing(void) {
-	if (fputc('0', tracing_on) == EOF ||
-	    fflush(tracing_on) == EOF) {
+int disable_tracing(struct tracer *tr) {
+	if (tr->use_bpf) {
+		trace_bpf_enable(tr->bpf, 0);
+		return 0;
+	}
+	if (tr->use_perf)
+		return trace_perf_enable(tr->perf, 0);
+	if (fputc('0', tr->tracing_on) == EOF ||
+	    fflush(tr->tracing_on) == EOF) {
 		fprintf(stderr, "%s: write to tracing_on %m\n", __func__);
 		return -1;
 	}
 	return 0;
 }
 
-static inline void *cpu_page(struct tracer *tr, int idx) {
-	return ((char *)tr->pages) + (idx * getpagesize());
+static inline struct race_point *lookup_race_point(struct tracer *tr,
+						  unsigned long long event_id) {
+	int i = id_index_lookup(&tr->race_point_ids, event_id);
+
+	return i < 0 ? NULL : &tr->race_points[i];
+}
+
+// fill in event->target from event->pid, or return 0 if it's not ours
+static inline int lookup_pid(struct tracer *tr, struct race_event *event) {
+	event->target = pid_table_lookup(&tr->pids, event->pid);
+	return event->target >= 0;
+}
+
+// the point's value_arg from record, an event it was hit with
+static inline unsigned long long read_value(const struct race_point *p,
+					    const void *record) {
+	unsigned long long value = 0;
+
+	// little endian, like the rest of the fast path
+	if (p->value_size)
+		memcpy(&value, (const char *)record + p->value_offset, p->value_size);
+	return value;
 }
 
 static struct race_point *match_race_event(struct tracer *tr,
@@ -770,34 +1442,64 @@ static struct race_point *match_race_event(struct tracer *tr,
 					   void *ftrace_event) {
 	unsigned long long event_id;
 	tep_read_number_field(tr->common_type, ftrace_event, &event_id);
+
+	struct race_point *p = lookup_race_point(tr, event_id);
+	if (!p)
+		return NULL;
 	tep_read_number_field(tr->common_pid, ftrace_event, &event->pid);
+	if (!lookup_pid(tr, event))
+		return NULL;
+	event->time = kbuffer_timestamp(kbuf);
+	event->value = read_value(p, ftrace_event);
+	return p;
+}
 
-	for (int i = 0; 1; i++) {
-		if (event->pid == tr->race.statuses[i].pid)
-			break;
 
-		if (i == tr->num_targets - 1)
-			return NULL;
-	}
+// Move on to whatever the kernel has for us after the reader
+// sub-buffer we're on, and return its first event.
+static void *read_mapped_event(struct trace_cpu *c, int *missed_events) {
+	struct trace_buffer_meta *meta = c->meta;
+	char *subbuf = c->data + (size_t)meta->subbuf_size * meta->reader.id;
+	void *event;
 
-	for (int i = 0; i < tr->num_race_points; i++) {
-		struct race_point *p = &tr->race_points[i];
-		if (p->event_id == event_id) {
-			event->time = kbuffer_timestamp(kbuf);
-			return p;
+	if (subbuf == kbuffer_subbuffer(c->kbuf)) {
+		// writers might have added to it since we looked
+		kbuffer_refresh(c->kbuf);
+		event = kbuffer_read_event(c->kbuf, NULL);
+		if (event)
+			return event;
+
+		// done with it, so ask for the next one
+		if (ioctl(c->fd, TRACE_MMAP_IOCTL_GET_READER) < 0)
+			return NULL;
+		subbuf = c->data + (size_t)meta->subbuf_size * meta->reader.id;
+		if (subbuf == kbuffer_subbuffer(c->kbuf)) {
+			kbuffer_refresh(c->kbuf);
+			return kbuffer_read_event(c->kbuf, NULL);
 		}
+		kbuffer_load_subbuffer(c->kbuf, subbuf);
+	} else {
+		kbuffer_load_subbuffer(c->kbuf, subbuf);
+		// skip anything already consumed with read()
+		if (meta->reader.read)
+			kbuffer_read_at_offset(c->kbuf, meta->reader.read, NULL);
 	}
-	return NULL;
+	*missed_events = kbuffer_missed_events(c->kbuf);
+	return kbuffer_read_event(c->kbuf, NULL);
 }
 
 static void *read_event(struct tracer *tr, int cpu, int *missed_events) {
-	struct kbuffer *kbuf = tr->kbufs[cpu];
-	int n = read(trace_fds[cpu], cpu_page(tr, cpu), getpagesize());
+	struct trace_cpu *c = &tr->percpu[cpu];
+
+	if (c->meta)
+		return read_mapped_event(c, missed_events);
+
+	int n = read(c->fd, c->page, tr->subbuf_size);
 	if (n <= 0)
 		return NULL;
-	kbuffer_load_subbuffer(kbuf, cpu_page(tr, cpu));
-	*missed_events = kbuffer_missed_events(kbuf);
-	return kbuffer_read_event(kbuf, NULL);
+	kbuffer_load_subbuffer(c->kbuf, c->page);
+	*missed_events = kbuffer_missed_events(c->kbuf);
+	return kbuffer_read_event(c->kbuf, NULL);
 }
 
 static inline void next_event(struct kbuffer *kbuf, int *entries) {
@@ -805,140 +1507,676 @@ static inline void next_event(struct kbuffer *kbuf, int *entries) {
 	(*entries)++;
 }
 
-static struct race_event *current_event(struct tracer *tr, int cpu, int *entries, int *missed_events) {
-	struct race_event *re = &tr->current_events[cpu];
-	if (re->point)
-		return re;
+static int push_event(struct trace_cpu *c, struct race_event *re) {
+	if (c->num_events == c->max_events) {
+		int max = c->max_events ? 2 * c->max_events : 64;
+		struct race_event *events = realloc(c->events, sizeof(*events) * max);
+		if (!events)
+			return ENOMEM;
+		c->events = events;
+		c->max_events = max;
+	}
+	c->events[c->num_events] = *re;
+	// into the reference CPU's clock, see tracer_calibrate_skew()
+	c->events[c->num_events++].time -= c->skew;
+	return 0;
+}
+
+// The parts of the ring buffer format (see
+// kernel/trace/ring_buffer.c) that decode_subbuf() needs. Each event
+// starts with a 32 bit header, type_len in the low 5 bits and a time
+// delta in the rest.
+#define RB_TYPE_PADDING 29
+#define RB_TYPE_TIME_EXTEND 30
+#define RB_TYPE_TIME_STAMP 31
+#define RB_TS_SHIFT 27
+// absolute timestamps only have this many bits, the rest come from the
+// sub-buffer's timestamp
+#define RB_TS_MASK ((1ULL << 59) - 1)
+// low bits of the commit field, the rest are flags
+#define RB_COMMIT_MASK ((1U << 27) - 1)
+#define RB_MISSED_EVENTS (1UL << 31)
+
+// the commit field, which writers might still be updating if they're on
+// the mapped reader sub-buffer
+static inline unsigned long subbuf_commit(struct tracer *tr, char *subbuf) {
+	if (tr->commit_size == 8)
+		return __atomic_load_n((unsigned long long *)(subbuf + 8), __ATOMIC_ACQUIRE);
+	return __atomic_load_n((unsigned int *)(subbuf + 8), __ATOMIC_ACQUIRE);
+}
+
+static inline void start_subbuf(struct trace_cpu *c, char *subbuf) {
+	c->subbuf = subbuf;
+	c->subbuf_off = 0;
+	c->subbuf_ts = *(unsigned long long *)subbuf;
+}
+
+// Like read_event(), but for decode_subbuf(): get a sub-buffer with
+// something in it past c->subbuf_off, setting c->subbuf and friends if
+// it's a new one. *skip is how much of a new one was already consumed.
+static char *next_subbuf(struct tracer *tr, struct trace_cpu *c,
+			 unsigned int *skip, int *missed_events) {
+	struct trace_buffer_meta *meta = c->meta;
+
+	*skip = 0;
+	if (!meta) {
+		int n = read(c->fd, c->page, tr->subbuf_size);
+		if (n <= 0)
+			return NULL;
+		start_subbuf(c, c->page);
+	} else {
+		char *subbuf = c->data + (size_t)meta->subbuf_size * meta->reader.id;
+
+		if (subbuf == c->subbuf) {
+			if ((subbuf_commit(tr, subbuf) & RB_COMMIT_MASK) > c->subbuf_off)
+				return subbuf;
+			if (ioctl(c->fd, TRACE_MMAP_IOCTL_GET_READER) < 0)
+				return NULL;
+			subbuf = c->data + (size_t)meta->subbuf_size * meta->reader.id;
+			if (subbuf == c->subbuf)
+				return (subbuf_commit(tr, subbuf) & RB_COMMIT_MASK) > c->subbuf_off ?
+					subbuf : NULL;
+		}
+		start_subbuf(c, subbuf);
+		*skip = meta->reader.read;
+	}
+	if (subbuf_commit(tr, c->subbuf) & RB_MISSED_EVENTS)
+		*missed_events = 1;
+	return c->subbuf;
+}
+
+// Decode c->subbuf from c->subbuf_off on by hand, with no calls per
+// event other than to push_event(). Events before skip are only
+// walked through for their timestamps. Returns nonzero if we ran out
+// of memory.
+static int decode_subbuf(struct tracer *tr, struct trace_cpu *c,
+			 unsigned int skip) {
+	char *data = c->subbuf + 8 + tr->commit_size;
+	unsigned int end = subbuf_commit(tr, c->subbuf) & RB_COMMIT_MASK;
+	unsigned int off = c->subbuf_off;
+	unsigned long long ts = c->subbuf_ts;
+	int err = 0;
+
+	while (off + 4 <= end) {
+		unsigned int header = *(unsigned int *)(data + off);
+		unsigned int type_len = header & 0x1f;
+		unsigned long long delta = header >> 5;
+		unsigned int start = off;
+		char *record;
+
+		switch (type_len) {
+		case RB_TYPE_PADDING:
+			// a null event means nothing else is in this one
+			if (!delta) {
+				off = end;
+				continue;
+			}
+			ts += delta;
+			off += 4 + *(unsigned int *)(data + off + 4);
+			continue;
+		case RB_TYPE_TIME_EXTEND:
+			ts += delta | (unsigned long long)*(unsigned int *)(data + off + 4) << RB_TS_SHIFT;
+			off += 8;
+			continue;
+		case RB_TYPE_TIME_STAMP:
+			delta |= (unsigned long long)*(unsigned int *)(data + off + 4) << RB_TS_SHIFT;
+			ts = (ts & ~RB_TS_MASK) | delta;
+			off += 8;
+			continue;
+		case 0:
+			record = data + off + 8;
+			off += 8 + ((*(unsigned int *)(data + off + 4) - 4 + 3) & ~3U);
+			break;
+		default:
+			record = data + off + 4;
+			off += 4 + type_len * 4;
+			break;
+		}
+		ts += delta;
+		if (start < skip)
+			continue;
+		c->entries++;
+
+		struct common_fields *common = (struct common_fields *)record;
+		struct race_event re;
+		re.point = lookup_race_point(tr, common->type);
+		if (!re.point)
+			continue;
+		re.pid = common->pid;
+		if (!lookup_pid(tr, &re))
+			continue;
+		re.time = ts;
+		re.value = read_value(re.point, record);
+		// keep emptying the buffer even if we can't keep up
+		if (!err && push_event(c, &re))
+			err = ENOMEM;
+	}
+	c->subbuf_off = off;
+	c->subbuf_ts = ts;
+	return err;
+}
+
+static int fast_decode_cpu(struct tracer *tr, struct trace_cpu *c) {
+	char *subbuf;
+	unsigned int skip;
+	int missed = 0;
+	int oom = 0;
+
+	while ((subbuf = next_subbuf(tr, c, &skip, &missed)))
+		if (decode_subbuf(tr, c, skip))
+			oom = 1;
+	if (missed)
+		c->missed = 1;
+	return oom;
+}
+
+static int kbuffer_decode_cpu(struct tracer *tr, int cpu) {
+	struct trace_cpu *c = &tr->percpu[cpu];
+	int oom = 0;
 
 	while (1) {
-		void *event = kbuffer_read_event(tr->kbufs[cpu], NULL);
+		struct race_event re;
+		int missed = 0;
+
+		void *event = kbuffer_read_event(c->kbuf, NULL);
 		if (!event)
-			event = read_event(tr, cpu, missed_events);
+			event = read_event(tr, cpu, &missed);
+		if (missed)
+			c->missed = 1;
 		if (!event)
+			return oom;
+
+		re.point = match_race_event(tr, &re, c->kbuf, event);
+		// keep emptying the buffer even if we can't keep up
+		if (re.point && !oom && push_event(c, &re))
+			oom = 1;
+		next_event(c->kbuf, &c->entries);
+	}
+}
+
+// what perf_decode() hands trace_perf_read()
+struct perf_source {
+	struct tracer *tr;
+	struct trace_cpu *c;
+	int target;
+	int oom;
+};
+
+static void push_perf_event(void *arg, int point, int cpu,
+			    unsigned long long time) {
+	struct perf_source *src = arg;
+	struct tracer *tr = src->tr;
+	struct race_event re = {
+		// the ring has events from whatever CPUs the pid ran on
+		.time = tr->cpu_skew && cpu >= 0 && cpu < CPU_SETSIZE ?
+			time - tr->cpu_skew[cpu] : time,
+		.pid = src->tr->race.statuses[src->target].pid,
+		.target = src->target,
+		.point = &src->tr->race_points[point],
+		.value = 0,
+	};
+
+	src->c->entries++;
+	// keep emptying the ring even if we can't keep up
+	if (!src->oom && push_event(src->c, &re))
+		src->oom = 1;
+}
+
+// Everything in target's perf ring is ours already, and tagged with
+// its race point, so there's nothing to match.
+static int perf_decode(struct tracer *tr, int target) {
+	struct perf_source src = {
+		.tr = tr,
+		.c = &tr->percpu[target],
+		.target = target,
+	};
+
+	unsigned long long lost = trace_perf_read(tr->perf, target, push_perf_event, &src);
+	if (lost) {
+		src.c->missed = 1;
+		src.c->lost += lost;
+	}
+	return src.oom;
+}
+
+// Go through everything in cpu's buffer, adding the events that are
+// race points hit by one of our pids to its events. Only touches that
+// CPU's trace_cpu, so different CPUs can be decoded at the same time.
+// With use_perf, cpu is really a target.
+static void decode_cpu(struct tracer *tr, int cpu) {
+	struct trace_cpu *c = &tr->percpu[cpu];
+	int oom;
+
+	if (tr->use_perf)
+		oom = perf_decode(tr, cpu);
+	else if (tr->fast_decode)
+		oom = fast_decode_cpu(tr, c);
+	else
+		oom = kbuffer_decode_cpu(tr, cpu);
+	if (oom) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		c->missed = 1;
+	}
+}
+
+static void decode_cpus(struct tracer *tr) {
+	int cpu;
+
+	while ((cpu = __atomic_fetch_add(&tr->next_cpu, 1, __ATOMIC_RELAXED)) <
+	       tr->num_sources)
+		decode_cpu(tr, cpu);
+}
+
+static void *decode_func(void *arg) {
+	struct tracer *tr = arg;
+	int gen = 0;
+
+	while (1) {
+		sync_wait_change(&tr->decode_start, gen, tr->decode_spin);
+		gen = __atomic_load_n(&tr->decode_start.val, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&tr->decode_stop, __ATOMIC_ACQUIRE))
 			return NULL;
+		decode_cpus(tr);
+		sync_inc(&tr->decode_done);
+	}
+}
 
-		struct race_point *p = match_race_event(tr, re, tr->kbufs[cpu], event);
-		if (p) {
-			re->point = p;
-			return re;
+// One thread per traced CPU, counting the one calling
+// tracer_collect_stats(), as long as there are CPUs to run them on.
+// They're pinned to cpus, the ones no worker runs on, so their
+// spinning after a collect doesn't get in the way of the next batch.
+// If there are none, they go anywhere, but sleep right away instead
+// of spinning. If we can't start them all, we just make do with fewer.
+static void start_decoders(struct tracer *tr, const cpu_set_t *cpus) {
+	int n = tr->num_cpus;
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_attr_t attr;
+
+	if (online > 0 && online < n)
+		n = online;
+	if (CPU_COUNT(cpus) && CPU_COUNT(cpus) + 1 < n)
+		n = CPU_COUNT(cpus) + 1;
+	if (n < 2)
+		return;
+	tr->decoders = malloc(sizeof(*tr->decoders) * (n - 1));
+	if (!tr->decoders)
+		return;
+	pthread_attr_init(&attr);
+	if (CPU_COUNT(cpus)) {
+		pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+		tr->decode_spin = SYNC_SPIN_LIMIT;
+	} else {
+		tr->decode_spin = 0;
+	}
+	for (int i = 0; i < n - 1; i++) {
+		int err = pthread_create(&tr->decoders[i], &attr, decode_func, tr);
+		if (err) {
+			fprintf(stderr, "pthread create error: %s\n", strerror(err));
+			break;
 		}
-		next_event(tr->kbufs[cpu], entries);
+		tr->num_decoders++;
 	}
+	pthread_attr_destroy(&attr);
 }
 
-static void mark_race_effects(struct tracer *tr, int cpu) {
-	struct race_data *race = &tr->race;
-	unsigned long long pid = tr->current_events[cpu].pid;
-	struct race_point *point = tr->current_events[cpu].point;
+static void stop_decoders(struct tracer *tr) {
+	__atomic_store_n(&tr->decode_stop, 1, __ATOMIC_RELEASE);
+	sync_inc(&tr->decode_start);
+	for (int i = 0; i < tr->num_decoders; i++) {
+		int err = pthread_join(tr->decoders[i], NULL);
+		if (err)
+			fprintf(stderr, "pthread_join: %s\n", strerror(err));
+	}
+	free(tr->decoders);
+	tr->decoders = NULL;
+	tr->num_decoders = 0;
+	tr->decode_stop = 0;
+}
 
-	for (int i = 0; i < tr->num_targets; i++) {
-		if (race->statuses[i].pid != pid && point->triggers &&
-		    race->statuses[i].open)
-			race->triggers++;
-		if (race->statuses[i].pid != pid)
-			continue;
-		if (point->opens && !race->statuses[i].open) {
-			race->statuses[i].open = 1;
-			continue;
-		}
-		if (point->closes && race->statuses[i].open) {
-			race->count++;
-			race->statuses[i].open = 0;
+// How long the collector thread sleeps between passes over the buffers.
+// Short enough that even busy kprobes don't fill up a buffer in between.
+#define COLLECT_INTERVAL_NS 1000000
+
+static void *collector_func(void *arg) {
+	struct tracer *tr = arg;
+	struct timespec interval = { .tv_nsec = COLLECT_INTERVAL_NS };
+
+	while (!__atomic_load_n(&tr->collector_stop, __ATOMIC_ACQUIRE)) {
+		// just this thread, the decoders would land on worker CPUs
+		pthread_mutex_lock(&tr->decode_lock);
+		for (int i = 0; i < tr->num_sources; i++)
+			decode_cpu(tr, i);
+		pthread_mutex_unlock(&tr->decode_lock);
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+
+int tracer_start_collector(struct tracer *tr, const cpu_set_t *cpus) {
+	pthread_attr_t attr;
+
+	// nothing to drain
+	if (tr->use_bpf)
+		return 0;
+
+	pthread_attr_init(&attr);
+	if (CPU_COUNT(cpus))
+		pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+	else
+		fprintf(stderr, "no CPUs free for the trace collector thread, "
+			"it'll compete with the workers\n");
+	int err = pthread_create(&tr->collector, &attr, collector_func, tr);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		fprintf(stderr, "pthread create error: %s\n", strerror(err));
+		return err;
+	}
+	tr->collector_running = 1;
+	start_decoders(tr, cpus);
+	return 0;
+}
+
+static void stop_collector(struct tracer *tr) {
+	if (!tr->collector_running)
+		return;
+	__atomic_store_n(&tr->collector_stop, 1, __ATOMIC_RELEASE);
+	int err = pthread_join(tr->collector, NULL);
+	if (err)
+		fprintf(stderr, "pthread_join: %s\n", strerror(err));
+	tr->collector_running = 0;
+	tr->collector_stop = 0;
+}
+
+static void decode_all(struct tracer *tr) {
+	int done = __atomic_load_n(&tr->decode_done.val, __ATOMIC_RELAXED) +
+		tr->num_decoders;
+	int val;
+
+	__atomic_store_n(&tr->next_cpu, 0, __ATOMIC_RELAXED);
+	sync_inc(&tr->decode_start);
+	decode_cpus(tr);
+	while ((val = __atomic_load_n(&tr->decode_done.val, __ATOMIC_ACQUIRE)) != done)
+		sync_wait_change(&tr->decode_done, val, SYNC_SPIN_LIMIT);
+}
+
+// Whether a's next event comes before b's. Ties go to the lower CPU,
+// so the order doesn't depend on how the heap happens to be laid out.
+static inline int event_before(struct tracer *tr, int a, int b) {
+	struct trace_cpu *ca = &tr->percpu[a];
+	struct trace_cpu *cb = &tr->percpu[b];
+	unsigned long long ta = ca->events[ca->next].time;
+	unsigned long long tb = cb->events[cb->next].time;
+
+	return ta < tb || (ta == tb && a < b);
+}
+
+static void sift_down(struct tracer *tr, int n, int i) {
+	int *heap = tr->heap;
+
+	while (1) {
+		int min = i;
+		int l = 2 * i + 1;
+		int r = l + 1;
+
+		if (l < n && event_before(tr, heap[l], heap[min]))
+			min = l;
+		if (r < n && event_before(tr, heap[r], heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		int tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+void tracer_set_event_hook(struct tracer *tr,
+			   void (*fn)(void *arg, const struct tracer_event *event),
+			   void *arg) {
+	tr->event_hook = fn;
+	tr->event_hook_arg = arg;
+}
+
+int tracer_calibrate_skew(struct tracer *tr) {
+	long long skew[CPU_SETSIZE] = {};
+	int ref = -1;
+
+	// no timestamps to correct
+	if (!tracer_same_clock(tr))
+		return 0;
+	if (!tr->cpu_skew) {
+		tr->cpu_skew = calloc(CPU_SETSIZE, sizeof(*tr->cpu_skew));
+		if (!tr->cpu_skew) {
+			fprintf(stderr, "%s: OOM\n", __func__);
+			return ENOMEM;
 		}
 	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &tr->cpus))
+			continue;
+		if (ref < 0)
+			ref = cpu;
+		int err = delay_measure_skew(ref, cpu, &skew[cpu]);
+		if (err)
+			return err;
+	}
+
+	pthread_mutex_lock(&tr->decode_lock);
+	memcpy(tr->cpu_skew, skew, sizeof(skew));
+	// perf sources are per pid, and push_perf_event() looks it up
+	if (!tr->use_perf)
+		for (int i = 0; i < tr->num_sources; i++)
+			tr->percpu[i].skew = skew[tr->percpu[i].id];
+	pthread_mutex_unlock(&tr->decode_lock);
+	return 0;
+}
+
+long long tracer_cpu_skew(struct tracer *tr, int cpu) {
+	if (!tr->cpu_skew || cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	return tr->cpu_skew[cpu];
+}
+
+int tracer_num_targets(struct tracer *tr) {
+	return tr->race.num_targets;
 }
 
-static void consume_event(struct tracer *tr, int cpu, int *entries) {
-	tr->current_events[cpu].point = NULL;
-	next_event(tr->kbufs[cpu], entries);
+int tracer_target_group(struct tracer *tr, int target) {
+	return tr->race.statuses[target].group;
 }
 
 int tracer_collect_stats(struct tracer *tr, int *entries,
-			 int *count, int *triggers) {
+			 struct tracer_results *results,
+			 unsigned long long end) {
 	int missed_events = 0;
+	race_start(&tr->race, results);
+
+	if (tr->use_bpf) {
+		trace_bpf_collect(tr->bpf, results, tr->race.num_groups);
+		*entries = 0;
+		return 0;
+	}
+
+	pthread_mutex_lock(&tr->decode_lock);
+	decode_all(tr);
+
+	int n = 0;
 	*entries = 0;
-	memset(tr->finished, 0, sizeof(int) * num_cpus);
-	tr->race.count = 0;
-	tr->race.triggers = 0;
+	tr->max_cpu_entries = 0;
+	for (int i = 0; i < tr->num_sources; i++) {
+		struct trace_cpu *c = &tr->percpu[i];
+
+		*entries += c->entries;
+		if (c->entries > tr->max_cpu_entries)
+			tr->max_cpu_entries = c->entries;
+		if (c->missed)
+			missed_events = 1;
+		c->entries = 0;
+		c->missed = 0;
+		if (c->num_events)
+			tr->heap[n++] = i;
+	}
+	for (int i = n / 2 - 1; i >= 0; i--)
+		sift_down(tr, n, i);
 
-	while (1) {
-		unsigned long long earliest = ~0ULL;
-		int cpu = -1;
-		for (int i = 0; i < num_cpus; i++) {
-			struct race_event *re;
-			int missed = 0;
-			if (tr->finished[i])
-				continue;
-			re = current_event(tr, i, entries, &missed);
-			if (missed) {
-				missed_events = 1;
-			}
-			if (!re) {
-				tr->finished[i] = 1;
-				continue;
-			}
-			if (re->time < earliest) {
-				earliest = re->time;
-				cpu = i;
-			}
-		}
-		if (cpu == -1) {
-			*count = tr->race.count;
-			*triggers = tr->race.triggers;
-			return missed_events;
+	while (n) {
+		struct trace_cpu *c = &tr->percpu[tr->heap[0]];
+
+		// the earliest one left, so everything else is later too
+		if (c->events[c->next].time >= end)
+			break;
+		struct race_event *e = &c->events[c->next++];
+
+		race_mark(&tr->race, e->target, e->point - tr->race_points,
+			  e->time, e->value);
+		if (tr->event_hook) {
+			struct tracer_event te = {
+				.time = e->time,
+				.target = e->target,
+				.point = e->point - tr->race_points,
+				.value = e->value,
+			};
+			tr->event_hook(tr->event_hook_arg, &te);
 		}
-		mark_race_effects(tr, cpu);
-		consume_event(tr, cpu, entries);
+		if (c->next == c->num_events)
+			tr->heap[0] = tr->heap[--n];
+		sift_down(tr, n, 0);
 	}
+
+	for (int i = 0; i < tr->num_sources; i++) {
+		struct trace_cpu *c = &tr->percpu[i];
+
+		c->num_events -= c->next;
+		memmove(c->events, c->events + c->next,
+			sizeof(*c->events) * c->num_events);
+		c->next = 0;
+	}
+	pthread_mutex_unlock(&tr->decode_lock);
+	return missed_events;
 }
 
-int ftrace_overrun(unsigned int *dst) {
-	int err = -1;
-	DIR *dir;
-	struct dirent *d;
-	char *path = tracefs_get_tracing_file("per_cpu");
-	if (!path) {
-		fprintf(stderr, "%s can't get per_cpu dir\n", __func__);
+// A guess at the bytes each event takes up in the ring buffer: our
+// kprobe events are 20, and every so often there's a time extend.
+#define EVENT_BYTES 32
+// how much bigger than what we expect a batch to need to make the buffers
+#define BUFFER_HEADROOM 2
+// don't go past this per CPU, whatever the measurements say
+#define MAX_BUFFER_SIZE_KB (256 * 1024)
+
+static int buffer_size_kb(struct tracer *tr) {
+	if (!tr->buffer_size_kb)
+		tr->buffer_size_kb = read_size_kb(tr, "buffer_size_kb");
+	return tr->buffer_size_kb;
+}
+
+int tracer_max_rounds(struct tracer *tr, int measured_rounds) {
+	unsigned long long bytes;
+
+	// BPF never drops anything
+	if (tr->use_bpf || tr->max_cpu_entries < 1 || measured_rounds < 1)
 		return -1;
+	// perf samples are 32 bytes too
+	if (tr->use_perf) {
+		bytes = trace_perf_ring_size(tr->perf);
+	} else {
+		int kb = buffer_size_kb(tr);
+		if (kb < 1)
+			return -1;
+		bytes = kb * 1024ULL;
 	}
-	dir = opendir(path);
-	if (!dir) {
-		fprintf(stderr, "%s can't open %s\n", __func__, path);
-		goto out_put_path;
+	unsigned long long rounds = bytes * measured_rounds /
+		((unsigned long long)tr->max_cpu_entries * EVENT_BYTES * BUFFER_HEADROOM);
+	return rounds > INT_MAX ? INT_MAX : rounds;
+}
+
+int tracer_fit_buffers(struct tracer *tr, int measured_rounds, int rounds) {
+	// don't resize anybody else's buffer
+	if (tr->use_bpf || tr->use_perf || !tr->instance || measured_rounds < 1)
+		return 0;
+
+	unsigned long long kb = (unsigned long long)tr->max_cpu_entries *
+		EVENT_BYTES * BUFFER_HEADROOM * rounds / measured_rounds / 1024 + 1;
+	if (kb > MAX_BUFFER_SIZE_KB)
+		kb = MAX_BUFFER_SIZE_KB;
+	int cur = buffer_size_kb(tr);
+	if (cur > 0 && kb <= cur)
+		return 0;
+
+	char val[32];
+	snprintf(val, sizeof(val), "%llu", kb);
+	pthread_mutex_lock(&tr->decode_lock);
+	// mapped buffers can't be resized, so everything gets reopened
+	close_trace_fds(tr);
+	int err = write_tracing_file(tr, "buffer_size_kb", val);
+	if (!err) {
+		tr->buffer_size_kb = kb;
+		err = reset_percpu(tr);
 	}
+	if (!err)
+		err = open_trace_fds(tr);
+	pthread_mutex_unlock(&tr->decode_lock);
+	if (err)
+		fprintf(stderr, "resizing ftrace buffers to %s KB failed\n", val);
+	return err;
+}
 
-	unsigned int overrun = 0;
-	while ((d = readdir(dir))) {
-		if (strncmp("cpu", d->d_name, 3))
+// the "overrun: N" line out of a per_cpu stats file
+static int read_overrun(int fd, unsigned long long *overrun) {
+	char buf[1024];
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n < 0) {
+		int err = errno;
+		fprintf(stderr, "reading per_cpu stats: %m\n");
+		return err;
+	}
+	buf[n] = '\0';
+	for (char *line = buf; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (sscanf(line, "overrun: %llu", overrun) == 1)
+			return 0;
+	}
+	fprintf(stderr, "no overrun in per_cpu stats\n");
+	return EINVAL;
+}
+
+int ftrace_overrun(struct tracer *tr, unsigned int *dst) {
+	unsigned long long total = 0;
+
+	if (tr->use_perf) {
+		*dst = trace_perf_lost(tr->perf);
+		return 0;
+	}
+	for (int i = 0; i < tr->num_sources; i++) {
+		struct trace_cpu *c = &tr->percpu[i];
+		unsigned long long overrun;
+
+		if (c->stats_fd < 0)
 			continue;
-		char *stats;
-		if (asprintf(&stats, "%s/%s/stats", path, d->d_name) == -1) {
-			fprintf(stderr, "%s asprintf error\n", __func__);
-			goto out_closedir;
-		}
-		FILE *file = fopen(stats, "r");
-		if (!file) {
-			fprintf(stderr, "%s: opening %s: %m\n", __func__, stats);
-			free(stats);
-			goto out_closedir;
-		}
-		free(stats);
+		int err = read_overrun(c->stats_fd, &overrun);
+		if (err)
+			return err;
+		// in case resizing the buffer started it over
+		c->lost += overrun >= c->overrun ? overrun - c->overrun : overrun;
+		c->overrun = overrun;
+		total += c->lost;
+	}
+	*dst = total;
+	return 0;
+}
 
-		while (1) {
-			unsigned int val;
-			char field[100];
-			if (fscanf(file, "%[^:]: %u ", field, &val) <= 0)
-				break;
-			if (!strcmp(field, "overrun"))
-				overrun += val;
-		}
-		fclose(file);
+int tracer_lost_events(struct tracer *tr, struct tracer_lost *lost, int n) {
+	// no buffers to overrun
+	if (tr->use_bpf)
+		return 0;
+
+	pthread_mutex_lock(&tr->decode_lock);
+	int num = tr->num_sources;
+	for (int i = 0; i < num && i < n; i++) {
+		lost[i].id = tr->percpu[i].id;
+		lost[i].lost = tr->percpu[i].lost;
 	}
-	err = 0;
-	*dst = overrun;
-out_closedir:
-	closedir(dir);
-out_put_path:
-	tracefs_put_tracing_file(path);
-	return err;
+	pthread_mutex_unlock(&tr->decode_lock);
+	return num;
 }
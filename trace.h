@@ -9,21 +9,124 @@
 #include <traceevent/kbuffer.h>
 
 #include "config.h"
+#include "race.h"
 
 struct tracer;
 
-struct tracer *alloc_tracer(struct k_race_config *config);
+struct tracer_options {
+	// Pids are split into this many groups that race independently
+	// of each other, and tracer_collect_stats() reports results per
+	// group.
+	int num_groups;
+	// if not 0, what to set buffer_subbuf_size_kb to while tracing
+	int subbuf_size_kb;
+	// Count results in BPF programs attached to the race points
+	// instead of decoding ftrace events (see trace_bpf.h). Nothing
+	// is ever missed then, but there are no timestamps, so
+	// tracer_same_clock() is always 0.
+	int bpf;
+	// Open the race points as perf events on each pid and read them
+	// from perf's mmap'd rings instead of from ftrace (see
+	// trace_perf.h). Only our pids' events are ever recorded then.
+	int perf;
+};
+
+struct tracer *alloc_tracer(struct k_race_config *config,
+			    const struct tracer_options *opts);
 void free_tracer(struct tracer *clr);
 
 int ftrace_init(struct tracer *clr);
-int tracer_add_pid(struct tracer *clr, pid_t pid);
-int ftrace_exit(void);
+int tracer_add_pid(struct tracer *clr, pid_t pid, int group);
+int ftrace_exit(struct tracer *clr);
+// Whether SIGINT came since ftrace_init(). The handler doesn't clean
+// up anything itself, so check this between batches, and if it's set,
+// stop, call ftrace_exit(), and then raise(SIGINT) again to do whatever
+// would have happened without us.
+int tracer_interrupted(struct tracer *clr);
+
+// Keep the ring buffers drained from a background thread pinned to
+// cpus (or anywhere, if it's empty), so they don't overrun during long
+// batches, and so tracer_collect_stats() has less left to decode.
+// Also starts the threads that help tracer_collect_stats() decode, on
+// the same CPUs. Stopped by ftrace_exit().
+int tracer_start_collector(struct tracer *clr, const cpu_set_t *cpus);
+
+// pass as end to tracer_collect_stats() to count everything
+#define TRACER_NO_END (~0ULL)
+
+// results should have one entry per group, with rounds filled in. Only
+// events before end count, and later ones are kept for the next call,
+// so tracing can stay on across batches. Returns nonzero if events
+// were lost since the last call.
 int tracer_collect_stats(struct tracer *clr, int *entries,
-			 int *counts, int *triggers);
+			 struct tracer_results *results,
+			 unsigned long long end);
+// An event tracer_collect_stats() credited
+struct tracer_event {
+	unsigned long long time;
+	// index of the pid it came from, in the order they were added
+	int target;
+	// index into the config's race_points
+	int point;
+	// the point's k_race_point.value_arg, or 0
+	unsigned long long value;
+};
+
+// Have tracer_collect_stats() pass each event it credits to fn, in the
+// order they're credited in. Never called with tracer_options.bpf.
+void tracer_set_event_hook(struct tracer *clr,
+			   void (*fn)(void *arg, const struct tracer_event *event),
+			   void *arg);
+
+// Measure how far each traced CPU's clock is ahead of the first one's,
+// and correct event timestamps by that from now on, so that events on
+// different CPUs are ordered right down to tens of ns. Only does
+// anything if tracer_same_clock(). Run it between batches, since it
+// needs a thread on each CPU for a bit. If it can't get one, returns
+// ETIMEDOUT and keeps correcting by the last skews it found.
+int tracer_calibrate_skew(struct tracer *clr);
+// what tracer_calibrate_skew() found for cpu, for correcting times
+// taken there with delay_now() the same way
+long long tracer_cpu_skew(struct tracer *clr, int cpu);
+
+int tracer_num_targets(struct tracer *clr);
+int tracer_target_group(struct tracer *clr, int target);
+
+// whether event timestamps are in DELAY_CLOCK time
+int tracer_same_clock(struct tracer *clr);
+
+// Grow each CPU's ring buffer to fit rounds rounds, going by how many
+// events the busiest CPU got in the last tracer_collect_stats(), which
+// covered measured_rounds rounds. Only done if we have our own ftrace
+// instance, and call it between batches.
+int tracer_fit_buffers(struct tracer *clr, int measured_rounds, int rounds);
+
+// How many rounds the busiest buffer has room for, with the same
+// margin tracer_fit_buffers() leaves, going by the last
+// tracer_collect_stats(), which covered measured_rounds rounds. -1 if
+// there's no telling, or no limit.
+int tracer_max_rounds(struct tracer *clr, int measured_rounds);
+
+// Total events the kernel has dropped so far. Only this updates the
+// ftrace counts tracer_lost_events() reports.
+int ftrace_overrun(struct tracer *clr, unsigned int *overrun);
+
+struct tracer_lost {
+	// the CPU, or with tracer_options.perf, the pid
+	int id;
+	unsigned long long lost;
+};
+
+// Fills in up to n of the per-CPU (per-pid with perf) counts of dropped
+// events, and returns how many there are.
+int tracer_lost_events(struct tracer *clr, struct tracer_lost *lost, int n);
 
-int ftrace_overrun(unsigned int *overrun);
+int disable_tracing(struct tracer *clr);
+int enable_tracing(struct tracer *clr);
 
-int disable_tracing(void);
-int enable_tracing(void);
+// Split a "func+0x10" style kprobe into func and 0x10, for the backends
+// that attach kprobes themselves.
+int parse_kprobe(const char *kprobe, char *func, size_t len,
+		 unsigned long *offset);
 
 #endif
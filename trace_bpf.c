@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#define _GNU_SOURCE
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "race.skel.h"
+#include "race_bpf_defs.h"
+#include "trace_bpf.h"
+
+struct trace_bpf {
+	struct race_bpf *skel;
+	int num_links;
+	struct bpf_link **links;
+};
+
+static int attach_point(struct trace_bpf *b, int i,
+			const struct trace_bpf_point *p) {
+	char func[128];
+	unsigned long offset;
+	int err = parse_kprobe(p->kprobe, func, sizeof(func), &offset);
+	if (err) {
+		fprintf(stderr, "bad kprobe %s\n", p->kprobe);
+		return err;
+	}
+
+	LIBBPF_OPTS(bpf_kprobe_opts, opts,
+		    .bpf_cookie = i,
+		    .offset = offset,
+		    .retprobe = p->type == 'r');
+	b->links[i] = bpf_program__attach_kprobe_opts(b->skel->progs.race_point,
+						      func, &opts);
+	if (!b->links[i]) {
+		err = errno;
+		fprintf(stderr, "attaching BPF program to %s: %m\n", p->kprobe);
+		return err;
+	}
+	b->num_links++;
+	return 0;
+}
+
+struct trace_bpf *trace_bpf_open(int num_points,
+				 const struct trace_bpf_point *points,
+				 int num_groups) {
+	if (num_points > RACE_BPF_MAX_POINTS) {
+		fprintf(stderr, "at most %d race points are supported with BPF\n",
+			RACE_BPF_MAX_POINTS);
+		return NULL;
+	}
+	if (num_groups > RACE_BPF_MAX_GROUPS) {
+		fprintf(stderr, "at most %d shards are supported with BPF\n",
+			RACE_BPF_MAX_GROUPS);
+		return NULL;
+	}
+
+	struct trace_bpf *b = calloc(1, sizeof(*b));
+	if (!b) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return NULL;
+	}
+	b->links = calloc(num_points, sizeof(*b->links));
+	if (!b->links) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		goto free_b;
+	}
+	b->skel = race_bpf__open();
+	if (!b->skel) {
+		fprintf(stderr, "opening BPF object: %m\n");
+		goto free_links;
+	}
+	for (int i = 0; i < num_points; i++) {
+		b->skel->rodata->points[i].opens = points[i].opens;
+		b->skel->rodata->points[i].triggers = points[i].triggers;
+		b->skel->rodata->points[i].closes = points[i].closes;
+	}
+	b->skel->rodata->num_groups = num_groups;
+
+	int err = race_bpf__load(b->skel);
+	if (err) {
+		fprintf(stderr, "loading BPF programs: %s\n", strerror(-err));
+		goto destroy;
+	}
+	for (int i = 0; i < num_points; i++) {
+		err = attach_point(b, i, &points[i]);
+		if (err)
+			goto destroy;
+	}
+	return b;
+
+destroy:
+	trace_bpf_close(b);
+	return NULL;
+free_links:
+	free(b->links);
+free_b:
+	free(b);
+	return NULL;
+}
+
+void trace_bpf_close(struct trace_bpf *b) {
+	for (int i = 0; i < b->num_links; i++)
+		bpf_link__destroy(b->links[i]);
+	race_bpf__destroy(b->skel);
+	free(b->links);
+	free(b);
+}
+
+int trace_bpf_add_pid(struct trace_bpf *b, pid_t pid, int target, int group) {
+	__u32 key = pid;
+	__u32 val = target;
+
+	if (target >= RACE_BPF_MAX_TARGETS) {
+		fprintf(stderr, "at most %d pids can be traced with BPF\n",
+			RACE_BPF_MAX_TARGETS);
+		return ENOSPC;
+	}
+	// before the pid can be looked up
+	b->skel->bss->groups[target] = group;
+	if (bpf_map__update_elem(b->skel->maps.pids, &key, sizeof(key),
+				 &val, sizeof(val), BPF_ANY)) {
+		int err = errno;
+		fprintf(stderr, "adding pid %d to BPF map: %m\n", pid);
+		return err;
+	}
+	if (target >= b->skel->bss->num_targets)
+		__atomic_store_n(&b->skel->bss->num_targets, target + 1,
+				 __ATOMIC_RELEASE);
+	return 0;
+}
+
+void trace_bpf_enable(struct trace_bpf *b, int enabled) {
+	__atomic_store_n(&b->skel->bss->enabled, enabled, __ATOMIC_RELEASE);
+}
+
+void trace_bpf_collect(struct trace_bpf *b, struct tracer_results *results,
+		       int num_groups) {
+	struct race_bpf_counts *counts = b->skel->bss->results;
+
+	for (int i = 0; i < num_groups; i++) {
+		results[i].counts = __atomic_exchange_n(&counts[i].counts, 0,
+							__ATOMIC_RELAXED);
+		results[i].triggers = __atomic_exchange_n(&counts[i].triggers, 0,
+							  __ATOMIC_RELAXED);
+	}
+	// Like race_start() does with the pattern state. The workers are
+	// waiting for the next batch, so nothing of theirs is hitting the
+	// race points right now.
+	for (int i = 0; i < RACE_BPF_MAX_TARGETS; i++)
+		__atomic_store_n(&b->skel->bss->open[i], 0, __ATOMIC_RELAXED);
+}
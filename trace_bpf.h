@@ -0,0 +1,61 @@
+#ifndef TRACE_BPF_H
+#define TRACE_BPF_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+// The in-kernel backend for struct tracer (see tracer_options.bpf):
+// BPF programs on the race points keep track of open windows and count
+// results themselves, so all we do per batch is read the counters.
+// Only built with make BPF=1.
+
+struct trace_bpf;
+
+struct trace_bpf_point {
+	// 'p' or 'r', like in kprobe_events
+	char type;
+	// func or func+offset
+	const char *kprobe;
+	int opens;
+	int triggers;
+	int closes;
+};
+
+#ifdef K_RACE_BPF
+
+// Loads the programs and attaches them to points. Returns NULL on error.
+struct trace_bpf *trace_bpf_open(int num_points,
+				 const struct trace_bpf_point *points,
+				 int num_groups);
+void trace_bpf_close(struct trace_bpf *b);
+// target is the pid's index, in the order they were added
+int trace_bpf_add_pid(struct trace_bpf *b, pid_t pid, int target, int group);
+void trace_bpf_enable(struct trace_bpf *b, int enabled);
+// Fills in counts and triggers for each group, and resets them, along
+// with any windows left open, so nothing carries over to the next batch.
+void trace_bpf_collect(struct trace_bpf *b, struct tracer_results *results,
+		       int num_groups);
+
+#else
+
+static inline struct trace_bpf *trace_bpf_open(int num_points,
+					       const struct trace_bpf_point *points,
+					       int num_groups) {
+	fprintf(stderr, "built without BPF support, rebuild with make BPF=1\n");
+	return NULL;
+}
+static inline void trace_bpf_close(struct trace_bpf *b) {}
+static inline int trace_bpf_add_pid(struct trace_bpf *b, pid_t pid,
+				    int target, int group) {
+	return 0;
+}
+static inline void trace_bpf_enable(struct trace_bpf *b, int enabled) {}
+static inline void trace_bpf_collect(struct trace_bpf *b,
+				     struct tracer_results *results,
+				     int num_groups) {}
+
+#endif
+
+#endif
@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// Copyright (C) 2020 Marcelo Diop-Gonzalez
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "delay.h"
+#include "trace_perf.h"
+
+// data pages in each pid's ring, must be a power of 2
+#define RING_PAGES 256
+
+#define KPROBE_PMU "/sys/bus/event_source/devices/kprobe"
+
+struct perf_ring {
+	// one event per race point, all writing to the first one's ring
+	int *fds;
+	unsigned long long *ids;
+	struct perf_event_mmap_page *meta;
+	char *data;
+	size_t size;
+};
+
+struct perf_point {
+	int retprobe;
+	char func[128];
+	unsigned long offset;
+};
+
+struct trace_perf {
+	int pmu_type;
+	// bit of attr.config that makes a kretprobe
+	int retprobe_bit;
+	int num_points;
+	struct perf_point *points;
+	int num_rings;
+	struct perf_ring *rings;
+	int enabled;
+	unsigned long long lost;
+};
+
+// what every sample looks like with the sample_type set below
+struct sample {
+	struct perf_event_header header;
+	__u64 id;
+	__u32 pid;
+	__u32 tid;
+	__u64 time;
+	__u32 cpu;
+	__u32 res;
+};
+
+struct lost {
+	struct perf_event_header header;
+	__u64 id;
+	__u64 lost;
+};
+
+static int read_pmu_file(const char *name, const char *fmt, int *val) {
+	char path[128];
+
+	snprintf(path, sizeof(path), KPROBE_PMU "/%s", name);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		int err = errno;
+		fprintf(stderr, "opening %s: %m\n", path);
+		return err;
+	}
+	int n = fscanf(f, fmt, val);
+	fclose(f);
+	if (n != 1) {
+		fprintf(stderr, "can't parse %s\n", path);
+		return EINVAL;
+	}
+	return 0;
+}
+
+struct trace_perf *trace_perf_open(int num_points,
+				   const struct trace_perf_point *points) {
+	struct trace_perf *p = calloc(1, sizeof(*p));
+	if (!p) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return NULL;
+	}
+	if (read_pmu_file("type", "%d", &p->pmu_type) ||
+	    read_pmu_file("format/retprobe", "config:%d", &p->retprobe_bit))
+		goto free_p;
+
+	// the names get passed to the kernel again for every pid
+	p->points = calloc(num_points, sizeof(*p->points));
+	if (!p->points) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		goto free_p;
+	}
+	p->num_points = num_points;
+	for (int i = 0; i < num_points; i++) {
+		struct perf_point *pp = &p->points[i];
+
+		pp->retprobe = points[i].type == 'r';
+		if (parse_kprobe(points[i].kprobe, pp->func, sizeof(pp->func),
+				 &pp->offset)) {
+			fprintf(stderr, "bad kprobe %s\n", points[i].kprobe);
+			goto free_points;
+		}
+	}
+	return p;
+
+free_points:
+	free(p->points);
+free_p:
+	free(p);
+	return NULL;
+}
+
+static void close_ring(struct perf_ring *r, int num_points) {
+	if (r->meta)
+		munmap(r->meta, r->size + getpagesize());
+	for (int i = 0; i < num_points; i++)
+		if (r->fds[i] >= 0)
+			close(r->fds[i]);
+	free(r->fds);
+	free(r->ids);
+}
+
+void trace_perf_close(struct trace_perf *p) {
+	for (int i = 0; i < p->num_rings; i++)
+		close_ring(&p->rings[i], p->num_points);
+	free(p->rings);
+	free(p->points);
+	free(p);
+}
+
+static int open_event(struct trace_perf *p, struct perf_ring *r, pid_t pid,
+		      int i) {
+	struct perf_point *k = &p->points[i];
+	struct perf_event_attr attr = {
+		.type = p->pmu_type,
+		.size = sizeof(attr),
+		.config = k->retprobe ? 1ULL << p->retprobe_bit : 0,
+		.sample_period = 1,
+		.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+			PERF_SAMPLE_CPU,
+		.disabled = !p->enabled,
+		// just this thread
+		.inherit = 0,
+		// we drain the rings ourselves, so only wake up pollers
+		// when one is half full
+		.watermark = 1,
+		.wakeup_watermark = RING_PAGES / 2 * getpagesize(),
+		.use_clockid = 1,
+		.clockid = DELAY_CLOCK,
+		.kprobe_func = (uintptr_t)k->func,
+		.probe_offset = k->offset,
+	};
+
+	int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		int err = errno;
+		fprintf(stderr, "perf_event_open(%s+0x%lx) for pid %d: %m\n",
+			k->func, k->offset, pid);
+		return err;
+	}
+	r->fds[i] = fd;
+	if (ioctl(fd, PERF_EVENT_IOC_ID, &r->ids[i]) < 0) {
+		int err = errno;
+		perror("ioctl(PERF_EVENT_IOC_ID)");
+		return err;
+	}
+	if (i == 0)
+		return 0;
+	if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, r->fds[0]) < 0) {
+		int err = errno;
+		perror("ioctl(PERF_EVENT_IOC_SET_OUTPUT)");
+		return err;
+	}
+	return 0;
+}
+
+int trace_perf_add_pid(struct trace_perf *p, pid_t pid) {
+	struct perf_ring *rings = realloc(p->rings, sizeof(*rings) * (p->num_rings + 1));
+	if (!rings) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return ENOMEM;
+	}
+	p->rings = rings;
+
+	struct perf_ring *r = &rings[p->num_rings];
+	int err = ENOMEM;
+	memset(r, 0, sizeof(*r));
+	r->fds = malloc(sizeof(*r->fds) * p->num_points);
+	r->ids = calloc(p->num_points, sizeof(*r->ids));
+	if (!r->fds || !r->ids) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		goto close;
+	}
+	for (int i = 0; i < p->num_points; i++)
+		r->fds[i] = -1;
+
+	for (int i = 0; i < p->num_points; i++) {
+		err = open_event(p, r, pid, i);
+		if (err)
+			goto close;
+		if (i > 0)
+			continue;
+
+		r->size = (size_t)RING_PAGES * getpagesize();
+		void *m = mmap(NULL, r->size + getpagesize(), PROT_READ | PROT_WRITE,
+			       MAP_SHARED, r->fds[0], 0);
+		if (m == MAP_FAILED) {
+			err = errno;
+			fprintf(stderr, "mapping perf ring for pid %d: %m\n", pid);
+			goto close;
+		}
+		r->meta = m;
+		r->data = (char *)m + getpagesize();
+	}
+	p->num_rings++;
+	return 0;
+
+close:
+	close_ring(r, p->num_points);
+	return err;
+}
+
+int trace_perf_enable(struct trace_perf *p, int enabled) {
+	unsigned long req = enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+
+	p->enabled = enabled;
+	for (int i = 0; i < p->num_rings; i++) {
+		for (int j = 0; j < p->num_points; j++) {
+			if (ioctl(p->rings[i].fds[j], req, 0) < 0) {
+				int err = errno;
+				perror("ioctl(PERF_EVENT_IOC_ENABLE)");
+				return err;
+			}
+		}
+	}
+	return 0;
+}
+
+static inline int point_for_id(struct trace_perf *p, struct perf_ring *r,
+			       unsigned long long id) {
+	// there are only ever a handful
+	for (int i = 0; i < p->num_points; i++)
+		if (r->ids[i] == id)
+			return i;
+	return -1;
+}
+
+unsigned long long trace_perf_read(struct trace_perf *p, int ring,
+				   void (*fn)(void *arg, int point, int cpu,
+					      unsigned long long time),
+				   void *arg) {
+	struct perf_ring *r = &p->rings[ring];
+	__u64 head = __atomic_load_n(&r->meta->data_head, __ATOMIC_ACQUIRE);
+	__u64 tail = r->meta->data_tail;
+	unsigned long long lost = 0;
+
+	while (tail < head) {
+		size_t off = tail & (r->size - 1);
+		struct perf_event_header *h = (struct perf_event_header *)(r->data + off);
+		char buf[sizeof(struct sample) > sizeof(struct lost) ?
+			 sizeof(struct sample) : sizeof(struct lost)];
+
+		// records are 8 byte aligned, so only the body can wrap
+		if (off + h->size > r->size && h->size <= sizeof(buf)) {
+			size_t first = r->size - off;
+
+			memcpy(buf, h, first);
+			memcpy(buf + first, r->data, h->size - first);
+			h = (struct perf_event_header *)buf;
+		}
+		if (h->type == PERF_RECORD_SAMPLE && h->size >= sizeof(struct sample)) {
+			struct sample *s = (struct sample *)h;
+			int point = point_for_id(p, r, s->id);
+
+			if (point >= 0)
+				fn(arg, point, s->cpu, s->time);
+		} else if (h->type == PERF_RECORD_LOST && h->size >= sizeof(struct lost)) {
+			lost += ((struct lost *)h)->lost;
+		}
+		tail += h->size;
+	}
+	__atomic_store_n(&r->meta->data_tail, tail, __ATOMIC_RELEASE);
+	if (lost)
+		__atomic_add_fetch(&p->lost, lost, __ATOMIC_RELAXED);
+	return lost;
+}
+
+unsigned long long trace_perf_lost(struct trace_perf *p) {
+	return __atomic_load_n(&p->lost, __ATOMIC_RELAXED);
+}
+
+size_t trace_perf_ring_size(struct trace_perf *p) {
+	return (size_t)RING_PAGES * getpagesize();
+}
@@ -0,0 +1,45 @@
+#ifndef TRACE_PERF_H
+#define TRACE_PERF_H
+
+#include <sys/types.h>
+
+#include "trace.h"
+
+// The perf_event_open() event source for struct tracer (see
+// tracer_options.perf). Each race point is a kprobe perf event opened
+// on each traced pid, and all of a pid's events go to one mmap'd ring
+// buffer, so only our pids' events ever show up, and nothing is copied
+// on the way out.
+
+struct trace_perf;
+
+struct trace_perf_point {
+	// 'p' or 'r', like in kprobe_events
+	char type;
+	// func or func+offset
+	const char *kprobe;
+};
+
+// Returns NULL on error.
+struct trace_perf *trace_perf_open(int num_points,
+				   const struct trace_perf_point *points);
+void trace_perf_close(struct trace_perf *p);
+// Opens the events and ring for pid. Rings are numbered in the order
+// their pids were added.
+int trace_perf_add_pid(struct trace_perf *p, pid_t pid);
+int trace_perf_enable(struct trace_perf *p, int enabled);
+// Hands each new sample in ring to fn, oldest first, with the index of
+// the race point it was for, the CPU it happened on and its DELAY_CLOCK
+// timestamp. Returns how
+// many the kernel had to drop since the last call. Different rings can
+// be read at the same time, but not while trace_perf_add_pid() runs.
+unsigned long long trace_perf_read(struct trace_perf *p, int ring,
+				   void (*fn)(void *arg, int point, int cpu,
+					      unsigned long long time),
+				   void *arg);
+// how many samples the kernel has dropped so far, from every ring
+unsigned long long trace_perf_lost(struct trace_perf *p);
+// bytes of samples each ring has room for
+size_t trace_perf_ring_size(struct trace_perf *p);
+
+#endif